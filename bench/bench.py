@@ -0,0 +1,249 @@
+import argparse
+import itertools
+import json
+import os
+import platform
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def parse_size(value):
+    suffixes = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    value = value.strip().upper()
+    if value and value[-1] in suffixes:
+        return int(float(value[:-1]) * suffixes[value[-1]])
+    return int(value)
+
+
+def parse_range(value):
+    parts = value.split(":")
+    low = int(parts[0])
+    high = int(parts[1]) if len(parts) > 1 else low
+    if low <= 0 or high < low:
+        raise argparse.ArgumentTypeError(f"invalid range {value}")
+    return low, high
+
+
+def parse_list(value):
+    return [item.strip() for item in value.split(",")]
+
+
+class Corpus:
+
+    LETTERS = b"abcdefghijklmnopqrstuvwxyz"
+
+    def __init__(self, rng, case_mix):
+        self.rng = rng
+
+        # Random bytes are mapped to letters, case_mix of them to uppercase ones. The text also has spaces.
+        letters = bytearray()
+        for i in range(256):
+            letter = self.LETTERS[i % len(self.LETTERS)]
+            letters.append(letter - 32 if i < 256 * case_mix else letter)
+        self.letters = bytes(letters)
+        self.text_table = bytes(ord(" ") if i % 8 == 7 else letters[i] for i in range(256))
+
+    def text(self, length):
+        return self.rng.randbytes(length).translate(self.text_table)
+
+    def keywords(self, count, length_range):
+        keywords = set()
+        while len(keywords) < count:
+            keywords.add(self.rng.randbytes(self.rng.randint(*length_range)).translate(self.letters))
+        return sorted(keywords)
+
+    def input(self, size, line_length, match_rate, keywords):
+        lines = []
+        total = 0
+        while total < size:
+            line = bytearray(self.text(self.rng.randint(max(1, line_length // 2), line_length * 3 // 2)))
+            if keywords and self.rng.random() < match_rate:
+                keyword = self.rng.choice(keywords)
+                offset = self.rng.randint(0, len(line))
+                line[offset:offset] = keyword
+            lines.append(bytes(line))
+            total += len(line) + 1
+        return b"\n".join(lines) + b"\n", len(lines)
+
+
+class Run:
+
+    STATS_PATTERN = re.compile(r"(built|loaded) in ([0-9.]+) s")
+
+    def __init__(self, binary, args, input_path, output_path):
+        self.cmd = [binary, "--stats", "-o", output_path] + args + [input_path]
+        self.output_path = output_path
+
+    def execute(self):
+        start = time.perf_counter()
+        process = subprocess.Popen(self.cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        stderr = process.stderr.read().decode(errors="replace")
+        process.stderr.close()
+        peak_rss_kb = None
+        if hasattr(os, "wait4"):
+            _, status, usage = os.wait4(process.pid, 0)
+            process.returncode = os.waitstatus_to_exitcode(status)
+            peak_rss_kb = usage.ru_maxrss
+        else:
+            process.wait()
+        seconds = time.perf_counter() - start
+        if process.returncode != 0:
+            raise RuntimeError(f"{' '.join(self.cmd)} exited with {process.returncode}: {stderr}")
+        match = self.STATS_PATTERN.search(stderr)
+        with open(self.output_path, "rb") as f:
+            matched_lines = sum(chunk.count(b"\n") for chunk in iter(lambda: f.read(1 << 20), b""))
+        return {
+            "seconds": seconds,
+            "build_seconds": float(match.group(2)) if match else None,
+            "peak_rss_kb": peak_rss_kb,
+            "matched_lines": matched_lines,
+        }
+
+
+class Bench:
+
+    def __init__(self, args):
+        self.args = args
+        self.tmp = tempfile.mkdtemp(prefix="findany-bench-")
+
+    def close(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+
+    def write(self, name, data):
+        path = os.path.join(self.tmp, name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def combinations(self):
+        args = self.args
+        cases = [[]]
+        if args.case_insensitive:
+            cases.append(["-i"])
+        return itertools.product(args.engines, cases, args.threads, args.options)
+
+    def run(self):
+        args = self.args
+        rng = random.Random(args.seed)
+        corpus = Corpus(rng, args.case_mix)
+        results = []
+        for keywords_count in args.keywords:
+            keywords = corpus.keywords(keywords_count, args.keyword_length)
+            keywords_path = self.write("keywords.txt", b"\n".join(keywords) + b"\n")
+            data, lines_count = corpus.input(args.input_size, args.line_length, args.match_rate, keywords)
+            input_path = self.write("input.txt", data)
+            for engine, case, threads, extra in self.combinations():
+                run_args = [f"--engine={engine}", f"-j{threads}"] + case + extra.split() + [keywords_path]
+                run = Run(args.binary, run_args, input_path, os.path.join(self.tmp, "output.txt"))
+                measures = [run.execute() for _ in range(args.repeat)]
+                best = min(measures, key=lambda measure: measure["seconds"])
+                best["peak_rss_kb"] = max((m["peak_rss_kb"] for m in measures if m["peak_rss_kb"] is not None), default=None)
+                result = {
+                    "keywords": keywords_count,
+                    "engine": engine,
+                    "case_insensitive": bool(case),
+                    "threads": threads,
+                    "options": extra,
+                    "input_bytes": len(data),
+                    "input_lines": lines_count,
+                    **best,
+                    "mb_per_s": len(data) / (1 << 20) / best["seconds"],
+                    "lines_per_s": lines_count / best["seconds"],
+                }
+                results.append(result)
+                print(self.format(result), file=sys.stderr)
+        return {
+            "machine": {
+                "system": platform.system(),
+                "machine": platform.machine(),
+                "processor": platform.processor(),
+                "cpus": os.cpu_count(),
+            },
+            "config": {
+                "seed": args.seed,
+                "keyword_length": list(args.keyword_length),
+                "input_size": args.input_size,
+                "line_length": args.line_length,
+                "match_rate": args.match_rate,
+                "case_mix": args.case_mix,
+                "repeat": args.repeat,
+            },
+            "results": results,
+        }
+
+    @staticmethod
+    def key(result):
+        return (result["keywords"], result["engine"], result["case_insensitive"], result["threads"], result["options"])
+
+    @staticmethod
+    def format(result):
+        return "{:>9} {:<12} {:<2} -j{:<3} {:<16} {:8.1f} MB/s {:10.0f} lines/s  build {} s  rss {} KB".format(
+            result["keywords"], result["engine"], "-i" if result["case_insensitive"] else "", result["threads"],
+            result["options"], result["mb_per_s"], result["lines_per_s"], result["build_seconds"], result["peak_rss_kb"])
+
+    @classmethod
+    def compare(cls, report, baseline, max_slowdown):
+        """
+        Returns the results that are slower than the same ones of the baseline by more than max_slowdown
+        """
+        previous = {cls.key(result): result for result in baseline["results"]}
+        slower = []
+        for result in report["results"]:
+            old = previous.get(cls.key(result))
+            if old is not None and result["mb_per_s"] < old["mb_per_s"] * (1 - max_slowdown):
+                slower.append((old, result))
+        return slower
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate synthetic keyword sets and inputs and measure findany on them")
+    parser.add_argument("--binary", default=os.path.join(os.path.dirname(__file__), "..", "build", "findany"))
+    parser.add_argument("--keywords", type=lambda v: [parse_size(x) for x in parse_list(v)], default=[100, 10000, 100000],
+                        help="comma-separated numbers of keywords, K and M suffixes are supported")
+    parser.add_argument("--keyword-length", type=parse_range, default=(6, 16), help="MIN:MAX length of keywords")
+    parser.add_argument("--input-size", type=parse_size, default=parse_size("32M"), help="size of the input, K, M and G suffixes are supported")
+    parser.add_argument("--line-length", type=int, default=200, help="average length of input lines")
+    parser.add_argument("--match-rate", type=float, default=0.01, help="fraction of input lines that contain a keyword")
+    parser.add_argument("--case-mix", type=float, default=0.0, help="fraction of uppercase letters in keywords and input")
+    parser.add_argument("--case-insensitive", action="store_true", help="also run every combination with -i")
+    parser.add_argument("--engines", type=parse_list, default=["auto", "aho-corasick", "trie"])
+    parser.add_argument("--threads", type=lambda v: [int(x) for x in parse_list(v)], default=[1])
+    parser.add_argument("--options", type=lambda v: v.split(","), default=[""],
+                        help="comma-separated sets of extra findany options, e.g. ',-m,--no-prefilter'")
+    parser.add_argument("--repeat", type=int, default=3, help="number of runs of each combination, the fastest one is reported")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--output", help="write the JSON report to this file instead of standard output")
+    parser.add_argument("--baseline", help="JSON report to compare with")
+    parser.add_argument("--max-slowdown", type=float, default=0.2, help="fail if any combination is slower than in the baseline by this fraction")
+    args = parser.parse_args()
+
+    bench = Bench(args)
+    try:
+        report = bench.run()
+    finally:
+        bench.close()
+
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline, "r") as f:
+            baseline = json.load(f)
+        slower = Bench.compare(report, baseline, args.max_slowdown)
+        for old, new in slower:
+            print(f"Slower: {Bench.format(new)} (was {old['mb_per_s']:.1f} MB/s)", file=sys.stderr)
+        if slower:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
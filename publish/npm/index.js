@@ -0,0 +1,61 @@
+const path = require("path");
+
+let binding = null;
+
+const CASE_INSENSITIVE = 1;
+const LONGEST = 2;
+const ENGINE_TRIE = 4;
+
+/**
+ * Keywords compiled once into the search index of findany. Strings are matched as UTF-8, offsets are in bytes.
+ */
+class Matcher {
+
+    /**
+     * @param {Array<string|Buffer>} keywords
+     * @param {{caseInsensitive?: boolean, longest?: boolean, engine?: "aho-corasick"|"trie"}} options
+     */
+    constructor(keywords, options = {}) {
+        let flags = 0;
+        if (options.caseInsensitive)
+            flags |= CASE_INSENSITIVE;
+        if (options.longest)
+            flags |= LONGEST;
+        if (options.engine === "trie")
+            flags |= ENGINE_TRIE;
+        // The addon is loaded on first use, so the package works as a command-line tool where it is not built
+        if (binding === null)
+            binding = require(path.join(__dirname, "bin", "findany.node"));
+        this.handle = binding.compile(Array.from(keywords), flags);
+    }
+
+    /**
+     * Returns true if the data contains any of the keywords
+     */
+    test(data) {
+        return binding.match(this.handle, data, false);
+    }
+
+    /**
+     * Returns the leftmost match as {offset, length} or null
+     */
+    search(data) {
+        return binding.match(this.handle, data, true);
+    }
+
+    /**
+     * Returns the results of test() for every item, the items are scanned in batches
+     */
+    testMany(items) {
+        return binding.matchMany(this.handle, Array.from(items), false);
+    }
+
+    /**
+     * Returns the results of search() for every item, the items are scanned in batches
+     */
+    searchMany(items) {
+        return binding.matchMany(this.handle, Array.from(items), true);
+    }
+}
+
+module.exports = { Matcher };
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2024-2025 Igor Belousov (https://github.com/imbelousov).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Node-API addon over libfindany. It is linked with the static library into a single findany.node,
+ * Node-API keeps it compatible with every later version of Node.js. The JavaScript interface is in index.js.
+ */
+
+#define NAPI_VERSION 8
+
+#include <node_api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "findany.h"
+
+#define BINDING_BATCH_SIZE 64
+
+#define binding_check(env, call) do\
+{\
+    if ((call) != napi_ok)\
+    {\
+        napi_throw_error((env), NULL, "findany: " #call " failed");\
+        return NULL;\
+    }\
+}\
+while (false)
+
+/**
+ * Bytes of a Buffer or of the UTF-8 encoding of a string. The string copy is owned by the caller.
+ */
+struct binding_bytes
+{
+    char* data;
+    size_t length;
+    bool owned;
+};
+
+bool binding_get_bytes(napi_env env, napi_value value, struct binding_bytes* bytes)
+{
+    bool is_buffer = false;
+    napi_is_buffer(env, value, &is_buffer);
+    if (is_buffer)
+    {
+        bytes->owned = false;
+        return napi_get_buffer_info(env, value, (void**)&bytes->data, &bytes->length) == napi_ok;
+    }
+    if (napi_get_value_string_utf8(env, value, NULL, 0, &bytes->length) != napi_ok)
+        return false;
+    bytes->data = malloc(bytes->length + 1);
+    if (bytes->data == NULL)
+        return false;
+    bytes->owned = true;
+    return napi_get_value_string_utf8(env, value, bytes->data, bytes->length + 1, &bytes->length) == napi_ok;
+}
+
+void binding_free_bytes(struct binding_bytes* bytes)
+{
+    if (bytes->owned)
+        free(bytes->data);
+}
+
+void binding_finalize(napi_env env, void* data, void* hint)
+{
+    findany_free(data);
+}
+
+napi_value binding_result(napi_env env, findany_result result)
+{
+    napi_value value;
+    if (result.length == 0)
+    {
+        napi_get_null(env, &value);
+        return value;
+    }
+    napi_value offset;
+    napi_value length;
+    napi_create_object(env, &value);
+    napi_create_int64(env, result.offset, &offset);
+    napi_create_int64(env, result.length, &length);
+    napi_set_named_property(env, value, "offset", offset);
+    napi_set_named_property(env, value, "length", length);
+    return value;
+}
+
+/**
+ * compile(keywords, flags) returns the matcher, it is freed by the garbage collector
+ */
+napi_value binding_compile(napi_env env, napi_callback_info info)
+{
+    size_t argc = 2;
+    napi_value argv[2];
+    binding_check(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+    uint32_t count;
+    uint32_t flags;
+    binding_check(env, napi_get_array_length(env, argv[0], &count));
+    binding_check(env, napi_get_value_uint32(env, argv[1], &flags));
+
+    struct binding_bytes* keywords = calloc(count > 0 ? count : 1, sizeof(struct binding_bytes));
+    const char** data = malloc(sizeof(char*) * (count > 0 ? count : 1));
+    size_t* lengths = malloc(sizeof(size_t) * (count > 0 ? count : 1));
+    bool ok = keywords != NULL && data != NULL && lengths != NULL;
+    uint32_t loaded = 0;
+    for (; ok && loaded < count; loaded++)
+    {
+        napi_value keyword;
+        ok = napi_get_element(env, argv[0], loaded, &keyword) == napi_ok && binding_get_bytes(env, keyword, &keywords[loaded]);
+        if (!ok)
+            break;
+        data[loaded] = keywords[loaded].data;
+        lengths[loaded] = keywords[loaded].length;
+    }
+    findany_matcher* matcher = ok ? findany_compile(data, lengths, count, flags) : NULL;
+    for (uint32_t i = 0; i < loaded; i++)
+        binding_free_bytes(&keywords[i]);
+    free(keywords);
+    free(data);
+    free(lengths);
+    if (matcher == NULL)
+    {
+        napi_throw_type_error(env, NULL, "findany: keywords must be strings or Buffers");
+        return NULL;
+    }
+
+    napi_value external;
+    binding_check(env, napi_create_external(env, matcher, binding_finalize, NULL, &external));
+    return external;
+}
+
+/**
+ * match(matcher, data, leftmost) returns a boolean, or the leftmost match as {offset, length} or null
+ */
+napi_value binding_match(napi_env env, napi_callback_info info)
+{
+    size_t argc = 3;
+    napi_value argv[3];
+    binding_check(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+    findany_matcher* matcher;
+    bool leftmost;
+    struct binding_bytes bytes;
+    binding_check(env, napi_get_value_external(env, argv[0], (void**)&matcher));
+    binding_check(env, napi_get_value_bool(env, argv[2], &leftmost));
+    if (!binding_get_bytes(env, argv[1], &bytes))
+    {
+        napi_throw_type_error(env, NULL, "findany: data must be a string or a Buffer");
+        return NULL;
+    }
+
+    findany_result result;
+    int found = findany_match(matcher, bytes.data, bytes.length, leftmost ? &result : NULL);
+    binding_free_bytes(&bytes);
+    if (leftmost)
+        return binding_result(env, result);
+    napi_value value;
+    binding_check(env, napi_get_boolean(env, found, &value));
+    return value;
+}
+
+/**
+ * matchMany(matcher, array, leftmost) returns an array of the results of match() for every item
+ */
+napi_value binding_match_many(napi_env env, napi_callback_info info)
+{
+    size_t argc = 3;
+    napi_value argv[3];
+    binding_check(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+    findany_matcher* matcher;
+    bool leftmost;
+    uint32_t count;
+    binding_check(env, napi_get_value_external(env, argv[0], (void**)&matcher));
+    binding_check(env, napi_get_array_length(env, argv[1], &count));
+    binding_check(env, napi_get_value_bool(env, argv[2], &leftmost));
+
+    napi_value results;
+    binding_check(env, napi_create_array_with_length(env, count, &results));
+    struct binding_bytes bytes[BINDING_BATCH_SIZE];
+    const void* data[BINDING_BATCH_SIZE];
+    size_t lengths[BINDING_BATCH_SIZE];
+    findany_result matches[BINDING_BATCH_SIZE];
+    for (uint32_t start = 0; start < count; start += BINDING_BATCH_SIZE)
+    {
+        uint32_t batch = count - start < BINDING_BATCH_SIZE ? count - start : BINDING_BATCH_SIZE;
+        uint32_t loaded = 0;
+        bool ok = true;
+        for (; loaded < batch; loaded++)
+        {
+            napi_value item;
+            ok = napi_get_element(env, argv[1], start + loaded, &item) == napi_ok && binding_get_bytes(env, item, &bytes[loaded]);
+            if (!ok)
+                break;
+            data[loaded] = bytes[loaded].data;
+            lengths[loaded] = bytes[loaded].length;
+        }
+        if (ok)
+            findany_match_batch(matcher, data, lengths, batch, matches, leftmost);
+        for (uint32_t i = 0; i < loaded; i++)
+            binding_free_bytes(&bytes[i]);
+        if (!ok)
+        {
+            napi_throw_type_error(env, NULL, "findany: data must be a string or a Buffer");
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < batch; i++)
+        {
+            napi_value value;
+            if (leftmost)
+                value = binding_result(env, matches[i]);
+            else
+                binding_check(env, napi_get_boolean(env, matches[i].length > 0, &value));
+            binding_check(env, napi_set_element(env, results, start + i, value));
+        }
+    }
+    return results;
+}
+
+napi_value binding_init(napi_env env, napi_value exports)
+{
+    napi_property_descriptor properties[] = {
+        {"compile", NULL, binding_compile, NULL, NULL, NULL, napi_default, NULL},
+        {"match", NULL, binding_match, NULL, NULL, NULL, napi_default, NULL},
+        {"matchMany", NULL, binding_match_many, NULL, NULL, NULL, napi_default, NULL}
+    };
+    binding_check(env, napi_define_properties(env, exports, sizeof(properties) / sizeof(properties[0]), properties));
+    return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, binding_init)
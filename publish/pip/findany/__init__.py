@@ -0,0 +1 @@
+from .matcher import Matcher
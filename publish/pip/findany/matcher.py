@@ -0,0 +1,112 @@
+import ctypes
+import os
+
+CASE_INSENSITIVE = 1
+LONGEST = 2
+ENGINE_TRIE = 4
+
+BATCH_SIZE = 1024
+
+
+class _Result(ctypes.Structure):
+    _fields_ = [("offset", ctypes.c_size_t), ("length", ctypes.c_size_t)]
+
+
+_library = None
+
+
+def _load():
+    global _library
+    if _library is not None:
+        return _library
+    name = "findany.dll" if os.name == "nt" else "libfindany.so"
+    library = ctypes.CDLL(os.path.join(os.path.dirname(__file__), "bin", name))
+    library.findany_abi_version.restype = ctypes.c_uint
+    library.findany_abi_version.argtypes = []
+    if library.findany_abi_version() != 1:
+        raise ImportError(f"{name} has an incompatible ABI version")
+    library.findany_compile.restype = ctypes.c_void_p
+    library.findany_compile.argtypes = [ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_size_t), ctypes.c_size_t, ctypes.c_uint]
+    library.findany_match.restype = ctypes.c_int
+    library.findany_match.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(_Result)]
+    library.findany_match_batch.restype = ctypes.c_size_t
+    library.findany_match_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_size_t), ctypes.c_size_t,
+                                            ctypes.POINTER(_Result), ctypes.c_int]
+    library.findany_free.restype = None
+    library.findany_free.argtypes = [ctypes.c_void_p]
+    _library = library
+    return library
+
+
+def _to_bytes(value):
+    return value.encode() if isinstance(value, str) else bytes(value)
+
+
+class Matcher:
+    """
+    Keywords compiled once into the search index of findany, the search runs in-process.
+    Strings are matched as UTF-8, offsets are in bytes.
+    """
+
+    def __init__(self, keywords, case_insensitive=False, longest=False, engine="aho-corasick"):
+        self._library = _load()
+        flags = (CASE_INSENSITIVE if case_insensitive else 0) | (LONGEST if longest else 0) | (ENGINE_TRIE if engine == "trie" else 0)
+        keywords = [_to_bytes(keyword) for keyword in keywords]
+        data = (ctypes.c_char_p * max(len(keywords), 1))(*keywords)
+        lengths = (ctypes.c_size_t * max(len(keywords), 1))(*map(len, keywords))
+        self._handle = self._library.findany_compile(data, lengths, len(keywords), flags)
+
+    def close(self):
+        if self._handle is not None:
+            self._library.findany_free(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def test(self, data):
+        """
+        Returns True if the data contains any of the keywords
+        """
+        data = _to_bytes(data)
+        return self._library.findany_match(self._handle, data, len(data), None) != 0
+
+    def search(self, data):
+        """
+        Returns the leftmost match as (offset, length) or None
+        """
+        data = _to_bytes(data)
+        result = _Result()
+        if not self._library.findany_match(self._handle, data, len(data), ctypes.byref(result)):
+            return None
+        return result.offset, result.length
+
+    def _match_many(self, items, leftmost):
+        items = [_to_bytes(item) for item in items]
+        results = []
+        for start in range(0, len(items), BATCH_SIZE):
+            batch = items[start:start + BATCH_SIZE]
+            data = (ctypes.c_char_p * len(batch))(*batch)
+            lengths = (ctypes.c_size_t * len(batch))(*map(len, batch))
+            matches = (_Result * len(batch))()
+            self._library.findany_match_batch(self._handle, data, lengths, len(batch), matches, int(leftmost))
+            results.extend(matches)
+        return results
+
+    def test_many(self, items):
+        """
+        Returns the results of test() for every item, the items are scanned in batches
+        """
+        return [result.length > 0 for result in self._match_many(items, False)]
+
+    def search_many(self, items):
+        """
+        Returns the results of search() for every item, the items are scanned in batches
+        """
+        return [(result.offset, result.length) if result.length > 0 else None for result in self._match_many(items, True)]
@@ -15,39 +15,115 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <smmintrin.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #ifdef _WIN32
+#include <io.h>
+#include <windows.h>
 #define stat _stat64
 #define fstat fstat64
+#define lstat stat
+#define lseek _lseeki64
 #else /* _WIN32 */
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #define O_BINARY 0
 #endif /* _WIN32 */
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif /* WITH_LZ4 */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif /* defined(__x86_64__) || defined(__i386__) */
+
 #define PROGRAM_NAME "findany"
 
+/**
+ * Identifiers of the options that have no short form
+ */
+enum long_only_option
+{
+    OPTION_ENGINE = 256,
+    OPTION_OUTPUT_BUFFER,
+    OPTION_NO_MMAP,
+    OPTION_SAVE_INDEX,
+    OPTION_LOAD_INDEX,
+    OPTION_NO_PREFILTER,
+    OPTION_SIMD,
+    OPTION_STATS,
+    OPTION_HUGE_PAGES,
+    OPTION_ALL_MATCHES,
+    OPTION_LONGEST,
+    OPTION_KEYWORD_STATS,
+    OPTION_COMPRESS_OUTPUT,
+    OPTION_SERVE,
+    OPTION_CONNECT,
+    OPTION_RANGE,
+    OPTION_DELIMITER,
+    OPTION_PROGRESS,
+    OPTION_EXPLAIN
+};
+
 const struct option long_options[] = {
     {"case-insensitive", no_argument, NULL, 'i'},
     {"invert", no_argument, NULL, 'v'},
     {"output", required_argument, NULL, 'o'},
+    {"progress", optional_argument, NULL, OPTION_PROGRESS},
     {"substring", required_argument, NULL, 's'},
     {"print-match", no_argument, NULL, 'm'},
+    {"all-matches", no_argument, NULL, OPTION_ALL_MATCHES},
+    {"longest", no_argument, NULL, OPTION_LONGEST},
+    {"count", no_argument, NULL, 'c'},
+    {"recursive", no_argument, NULL, 'r'},
+    {"with-filename", no_argument, NULL, 'H'},
+    {"null-data", no_argument, NULL, 'z'},
+    {"delimiter", required_argument, NULL, OPTION_DELIMITER},
+    {"engine", required_argument, NULL, OPTION_ENGINE},
+    {"threads", required_argument, NULL, 'j'},
+    {"output-buffer", required_argument, NULL, OPTION_OUTPUT_BUFFER},
+    {"no-mmap", no_argument, NULL, OPTION_NO_MMAP},
+    {"compress-output", required_argument, NULL, OPTION_COMPRESS_OUTPUT},
+    {"range", required_argument, NULL, OPTION_RANGE},
+    {"save-index", required_argument, NULL, OPTION_SAVE_INDEX},
+    {"load-index", required_argument, NULL, OPTION_LOAD_INDEX},
+    {"no-prefilter", no_argument, NULL, OPTION_NO_PREFILTER},
+    {"simd", required_argument, NULL, OPTION_SIMD},
+    {"stats", no_argument, NULL, OPTION_STATS},
+    {"explain", no_argument, NULL, OPTION_EXPLAIN},
+    {"huge-pages", no_argument, NULL, OPTION_HUGE_PAGES},
+    {"keyword-stats", required_argument, NULL, OPTION_KEYWORD_STATS},
+    {"serve", required_argument, NULL, OPTION_SERVE},
+    {"connect", required_argument, NULL, OPTION_CONNECT},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}
 };
 
-#define print_only_usage() printf("Usage: %s [OPTIONS] [SUBSTRINGS] [FILE]\n", PROGRAM_NAME)
+#define print_only_usage() printf("Usage: %s [OPTIONS] [SUBSTRINGS] [FILE]...\n", PROGRAM_NAME)
 
 void print_usage()
 {
@@ -58,7 +134,7 @@ void print_usage()
 void print_help()
 {
     print_only_usage();
-    printf("Find any substring from SUBSTRINGS in all lines of FILE and print the ones that contain at least one\n");
+    printf("Find any substring from SUBSTRINGS in all lines of each FILE and print the ones that contain at least one\n");
     printf("Read standard input if FILE is missing\n");
     printf("\n");
     printf("Options:\n");
@@ -66,45 +142,242 @@ void print_help()
     printf("  -v, --invert                 Search for lines that contain none of the specified substrings.\n");
     printf("  -o, --output OUTPUT          Redirect the output to OUTPUT instead of printing to standard output.\n");
     printf("                               It enables a progress-bar.\n");
+    printf("      --progress[=FORMAT]      Report the progress once a second as a bar (default) or as a line of JSON\n");
+    printf("                               with FORMAT json, or not at all with FORMAT none. The progress goes to\n");
+    printf("                               standard output if the output is redirected by -o, to standard error otherwise.\n");
     printf("  -s, --substring SUBSTRING    Receive a substring from a command-line argument instead of a file. It can be\n");
     printf("                               used multiple times. Must not be used together with the SUBSTRINGS argument.\n");
     printf("  -m, --print-match            Print only the first matched substring instead of the entire line.\n");
     printf("                               Cannot be used together with the --invert option.\n");
+    printf("      --all-matches            Print every occurrence of every substring as OFFSET:MATCH, where OFFSET is\n");
+    printf("                               the byte offset from the start of the file. Cannot be used together with\n");
+    printf("                               the --invert option.\n");
+    printf("      --longest                Take the longest of the substrings that start at the same offset instead of\n");
+    printf("                               the shortest one. Affects --print-match and --all-matches.\n");
+    printf("  -c, --count                  Print only the number of the selected lines, or of the matches with\n");
+    printf("                               --all-matches. The count is the total of all files.\n");
+    printf("  -r, --recursive              Search in all files of the directories given as FILE and their subdirectories.\n");
+    printf("  -H, --with-filename          Start every output line with the name of its file and a colon.\n");
+    printf("  -z, --null-data              Same as --delimiter '\\0'.\n");
+    printf("      --delimiter BYTE         End the substrings of SUBSTRINGS and the lines of the input with BYTE instead of\n");
+    printf("                               a line feed, the output lines are ended with it too. BYTE is a character or\n");
+    printf("                               one of the escapes \\0, \\t, \\n, \\r and \\xHH.\n");
+    printf("  -j, --threads N              Match the input on N threads. The order of the output lines is preserved.\n");
+    printf("                               The substrings are sorted on N threads too.\n");
+    printf("      --output-buffer SIZE     Collect the output in a buffer of SIZE bytes before writing. K, M and G suffixes\n");
+    printf("                               are supported. Default is 4M.\n");
+    printf("      --no-mmap                Read FILE with read() instead of mapping it into memory.\n");
+    printf("      --compress-output FORMAT Compress the output with FORMAT: gzip, zstd or lz4. Compressed input is\n");
+    printf("                               detected and decompressed regardless of this option.\n");
+    printf("      --range START:END        Search only the lines of a single regular FILE that start at the byte offsets\n");
+    printf("                               from START up to END. The line that crosses END is read to its end, so ranges\n");
+    printf("                               that adjoin each other split the lines between them. Either offset may be\n");
+    printf("                               omitted. K, M and G suffixes are supported.\n");
+    printf("      --save-index INDEX       Build the search index from the substrings, save it to INDEX and exit.\n");
+    printf("      --load-index INDEX       Load the search index from INDEX instead of building it from substrings.\n");
+    printf("                               Must not be used together with the SUBSTRINGS argument or --substring.\n");
+    printf("      --no-prefilter           Do not skip the parts of lines that cannot start any substring. By default, the\n");
+    printf("                               prefilter is used when the first bytes of the substrings are selective enough.\n");
+    printf("      --simd LEVEL             Do not use instruction sets above LEVEL: scalar, sse2, ssse3, avx2 or avx512.\n");
+    printf("                               By default, the best one supported by the CPU is used.\n");
+    printf("      --engine ENGINE          Select the matching engine: aho-corasick scans each line in a single pass,\n");
+    printf("                               trie restarts the search from every offset of the line, memmem searches for\n");
+    printf("                               a single case-sensitive substring. By default (auto), the engine is chosen\n");
+    printf("                               for the substrings.\n");
+    printf("      --huge-pages             Back the search index with huge pages to reduce TLB misses on large sets of\n");
+    printf("                               substrings. Reserved huge pages are used if available, transparent ones otherwise.\n");
+    printf("      --stats                  Print the size of the search index, the build time and the counters of the\n");
+    printf("                               search to standard error.\n");
+    printf("      --explain                Print the analysis of the substrings and the engine and prefilter chosen for\n");
+    printf("                               them to standard error.\n");
+    printf("      --keyword-stats FILE     Count the matches of every substring and write them to FILE as\n");
+    printf("                               SUBSTRING<TAB>COUNT, the most frequent first. The match of each line is\n");
+    printf("                               counted, or every match with --all-matches.\n");
+    printf("      --serve SOCKET           Build or load the search index once and serve searches on the Unix socket\n");
+    printf("                               SOCKET. Each connection sends lines and receives the selected ones back.\n");
+    printf("                               A line of 64 MiB or longer fails its connection.\n");
+    printf("                               On SIGHUP the index is reloaded, the open connections keep the previous one.\n");
+    printf("                               SIGINT and SIGTERM stop the server once the open connections are served.\n");
+    printf("                               Cannot be used together with FILE, -o, -r, -H, --save-index,\n");
+    printf("                               --compress-output, --stats and --keyword-stats.\n");
+    printf("      --connect SOCKET         Send each FILE to the server listening on SOCKET and print the lines it selects.\n");
+    printf("                               The search options are those of the server, -z and --delimiter must match\n");
+    printf("                               the ones it was started with.\n");
     printf("  -h, --help                   Display the help message and exit.\n");
 }
 
-#ifdef __SSE4_1__
-void* memchr_sse(void* buf, unsigned char val, size_t max_count)
+/**
+ * Instruction sets the SIMD kernels are compiled for. The best one supported by the CPU is selected at startup,
+ * so the binary does not have to be built for a particular CPU.
+ */
+enum simd_level
+{
+    SIMD_LEVEL_SCALAR,
+    SIMD_LEVEL_SSE2,
+    SIMD_LEVEL_SSSE3,
+    SIMD_LEVEL_AVX2,
+    SIMD_LEVEL_AVX512
+};
+
+const char* simd_level_names[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+
+struct prefilter;
+
+/**
+ * Kernels selected for the current CPU by simd_init()
+ */
+struct
+{
+    enum simd_level level;
+    void* (*memchr)(const void* buf, unsigned char val, size_t max_count);
+    void (*to_lower)(const unsigned char* src, unsigned char* dst, size_t length);
+
+    /**
+     * Returns the offset of the first occurrence of the needle in the data, or the length of the data
+     */
+    size_t (*memmem)(const unsigned char* data, size_t length, const unsigned char* needle, size_t needle_length);
+
+    /**
+     * Returns the first offset in [offset, end) where a keyword may start, or end
+     */
+    size_t (*prefilter_find)(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end);
+} simd;
+
+#define _memchr(buf, val, max_count) simd.memchr(buf, val, max_count)
+
+void* memchr_scalar(const void* buf, unsigned char val, size_t max_count)
+{
+    return memchr(buf, val, max_count);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+void* memchr_sse2(const void* buf, unsigned char val, size_t max_count)
 {
     size_t i = 0;
     __m128i vector_val = _mm_set1_epi8(val);
-    if (max_count >= 16)
+    for (; i + 16 <= max_count; i += 16)
     {
-        for (; i <= max_count - 16; i += 16)
-        {
-            __m128i vector_buf = _mm_loadu_si128(buf + i);
-            __m128i vector_result = _mm_cmpeq_epi8(vector_buf, vector_val);
-            if (_mm_testz_si128(vector_result, vector_result) == 0)
-            {
-                for (size_t j = 0; j < 16; j++)
-                {
-                    if (((unsigned char*)&vector_result)[j] != 0)
-                        return buf + i + j;
-                }
-            }
-        }
+        __m128i vector_buf = _mm_loadu_si128((const __m128i*)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(vector_buf, vector_val));
+        if (mask != 0)
+            return (void*)buf + i + __builtin_ctz(mask);
     }
     for (; i < max_count; i++)
     {
-        if (((unsigned char*)buf)[i] == val)
-            return buf + i;
+        if (((const unsigned char*)buf)[i] == val)
+            return (void*)buf + i;
     }
     return NULL;
 }
-#define _memchr(buf, val, max_count) memchr_sse(buf, val, max_count)
-#else /* __SSE4_1__ */
-#define _memchr(buf, val, max_count) memchr(buf, val, max_count)
-#endif /* __SSE4_1__ */
+
+__attribute__((target("avx2")))
+void* memchr_avx2(const void* buf, unsigned char val, size_t max_count)
+{
+    size_t i = 0;
+    __m256i vector_val = _mm256_set1_epi8(val);
+    for (; i + 32 <= max_count; i += 32)
+    {
+        __m256i vector_buf = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(vector_buf, vector_val));
+        if (mask != 0)
+            return (void*)buf + i + __builtin_ctz(mask);
+    }
+    for (; i < max_count; i++)
+    {
+        if (((const unsigned char*)buf)[i] == val)
+            return (void*)buf + i;
+    }
+    return NULL;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void* memchr_avx512(const void* buf, unsigned char val, size_t max_count)
+{
+    size_t i = 0;
+    __m512i vector_val = _mm512_set1_epi8(val);
+    for (; i + 64 <= max_count; i += 64)
+    {
+        __m512i vector_buf = _mm512_loadu_si512(buf + i);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(vector_buf, vector_val);
+        if (mask != 0)
+            return (void*)buf + i + __builtin_ctzll(mask);
+    }
+    if (i < max_count)
+    {
+        // The tail is loaded with a mask, masked-out bytes are never touched
+        __mmask64 tail = ((uint64_t)1 << (max_count - i)) - 1;
+        __m512i vector_buf = _mm512_maskz_loadu_epi8(tail, buf + i);
+        uint64_t mask = _mm512_mask_cmpeq_epi8_mask(tail, vector_buf, vector_val);
+        if (mask != 0)
+            return (void*)buf + i + __builtin_ctzll(mask);
+    }
+    return NULL;
+}
+
+#endif /* SIMD_X86 */
+
+size_t memmem_scalar(const unsigned char* data, size_t length, const unsigned char* needle, size_t needle_length)
+{
+    for (size_t i = 0; i + needle_length <= length; i++)
+    {
+        const unsigned char* found = memchr(data + i, needle[0], length - needle_length + 1 - i);
+        if (found == NULL)
+            break;
+        i = found - data;
+        if (memcmp(data + i, needle, needle_length) == 0)
+            return i;
+    }
+    return length;
+}
+
+#ifdef SIMD_X86
+/**
+ * Tests the first and the last byte of the needle at 16 offsets at once, only the offsets where both are equal
+ * are compared in full. Unlike a search for the first byte alone, a frequent first byte does not stop it at every offset.
+ */
+__attribute__((target("sse2")))
+size_t memmem_sse2(const unsigned char* data, size_t length, const unsigned char* needle, size_t needle_length)
+{
+    size_t i = 0;
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    for (; i + needle_length + 15 <= length; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(data + i + needle_length - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t offset = i + __builtin_ctz(mask);
+            if (memcmp(data + offset, needle, needle_length) == 0)
+                return offset;
+        }
+    }
+    return i + memmem_scalar(data + i, length - i, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+size_t memmem_avx2(const unsigned char* data, size_t length, const unsigned char* needle, size_t needle_length)
+{
+    size_t i = 0;
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    for (; i + needle_length + 31 <= length; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(data + i + needle_length - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t offset = i + __builtin_ctz(mask);
+            if (memcmp(data + offset, needle, needle_length) == 0)
+                return offset;
+        }
+    }
+    return i + memmem_scalar(data + i, length - i, needle, needle_length);
+}
+#endif /* SIMD_X86 */
 
 #define fatal(...) do\
 {\
@@ -114,6 +387,22 @@ void* memchr_sse(void* buf, unsigned char val, size_t max_count)
 while (false)
 #define fatal_nomem() fatal("Not enough memory")
 
+/**
+ * Message of the index that failed to load or build. A running server reloads its index, so the errors that depend
+ * on the contents of the files are returned with it instead of exiting.
+ */
+char index_error[1024];
+
+__attribute__((format(printf, 1, 2)))
+bool index_fail(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(index_error, sizeof(index_error), format, args);
+    va_end(args);
+    return false;
+}
+
 void* malloc_or_fatal(size_t size)
 {
     void* memory = malloc(size);
@@ -130,12 +419,35 @@ void* realloc_or_fatal(void* memory, size_t new_size)
     return memory;
 }
 
-int write_or_fatal(int file, void* buf, unsigned int max_char_count)
+#define IO_MAX_COUNT 1024 * 1024 * 1024
+
+int read_or_fatal(int file, void* buf, size_t count)
 {
-    int result = write(file, buf, max_char_count);
-    if (result < 0)
-        fatal("Failed to write");
-    return result;
+    while (true)
+    {
+        int result = read(file, buf, count > IO_MAX_COUNT ? IO_MAX_COUNT : count);
+        if (result >= 0)
+            return result;
+        if (errno != EINTR)
+            fatal("Failed to read");
+    }
+}
+
+void write_or_fatal(int file, const void* buf, size_t count)
+{
+    // A single write() may be partial and its count parameter is not wide enough for huge buffers on some platforms
+    while (count > 0)
+    {
+        int result = write(file, buf, count > IO_MAX_COUNT ? IO_MAX_COUNT : count);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fatal("Failed to write");
+        }
+        buf += result;
+        count -= result;
+    }
 }
 
 struct string
@@ -165,6 +477,14 @@ void string_expand(struct string* str, size_t min_length)
     str->length = min_length;
 }
 
+void string_append(struct string* buffer, size_t* length, struct string str)
+{
+    if (buffer->length < *length + str.length)
+        string_expand(buffer, (*length + str.length) * 2);
+    memcpy(buffer->data + *length, str.data, str.length);
+    *length += str.length;
+}
+
 struct string string_sub(const struct string str, size_t offset, size_t length)
 {
     struct string substring;
@@ -173,21 +493,92 @@ struct string string_sub(const struct string str, size_t offset, size_t length)
     return substring;
 }
 
-void string_to_lower(const struct string src, struct string* dst)
+unsigned char string_lower_lookup[256];
+
+/**
+ * Builds a mapping "char -> lowercase char" for the current locale. Must be called before any worker thread starts.
+ */
+void string_lower_lookup_init()
+{
+    for (int c = 0; c <= 255; c++)
+        string_lower_lookup[c] = tolower(c);
+}
+
+/**
+ * Checks whether the current locale lowercases only the ASCII letters, so the SIMD kernels apply
+ */
+bool string_lower_lookup_is_ascii()
+{
+    for (int c = 0; c <= 255; c++)
+    {
+        if (string_lower_lookup[c] != (c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c))
+            return false;
+    }
+    return true;
+}
+
+void string_to_lower_scalar(const unsigned char* src, unsigned char* dst, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        dst[i] = string_lower_lookup[src[i]];
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+void string_to_lower_sse2(const unsigned char* src, unsigned char* dst, size_t length)
+{
+    size_t i = 0;
+    __m128i a = _mm_set1_epi8('A');
+    __m128i range = _mm_set1_epi8('Z' - 'A');
+    __m128i bit = _mm_set1_epi8('a' - 'A');
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i shifted = _mm_sub_epi8(block, a);
+        __m128i upper = _mm_cmpeq_epi8(_mm_min_epu8(shifted, range), shifted);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(block, _mm_and_si128(upper, bit)));
+    }
+    string_to_lower_scalar(src + i, dst + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void string_to_lower_avx2(const unsigned char* src, unsigned char* dst, size_t length)
 {
-    static unsigned char* lookup = NULL;
+    size_t i = 0;
+    __m256i a = _mm256_set1_epi8('A');
+    __m256i range = _mm256_set1_epi8('Z' - 'A');
+    __m256i bit = _mm256_set1_epi8('a' - 'A');
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i shifted = _mm256_sub_epi8(block, a);
+        __m256i upper = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, range), shifted);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(block, _mm256_and_si256(upper, bit)));
+    }
+    string_to_lower_scalar(src + i, dst + i, length - i);
+}
 
-    if (lookup == NULL)
+__attribute__((target("avx512f,avx512bw")))
+void string_to_lower_avx512(const unsigned char* src, unsigned char* dst, size_t length)
+{
+    size_t i = 0;
+    __m512i a = _mm512_set1_epi8('A');
+    __m512i range = _mm512_set1_epi8('Z' - 'A');
+    __m512i bit = _mm512_set1_epi8('a' - 'A');
+    for (; i + 64 <= length; i += 64)
     {
-        // Build a mapping "char -> lowercase char"
-        lookup = malloc_or_fatal(256);
-        for (int c = 0; c <= 255; c++)
-            lookup[c] = tolower(c);
+        __m512i block = _mm512_loadu_si512(src + i);
+        __mmask64 upper = _mm512_cmple_epu8_mask(_mm512_sub_epi8(block, a), range);
+        _mm512_storeu_si512(dst + i, _mm512_mask_add_epi8(block, upper, block, bit));
     }
+    string_to_lower_scalar(src + i, dst + i, length - i);
+}
+#endif /* SIMD_X86 */
 
+void string_to_lower(const struct string src, struct string* dst)
+{
     string_expand(dst, src.length);
-    for (size_t i = 0; i < src.length; i++)
-        dst->data[i] = lookup[src.data[i]];
+    simd.to_lower(src.data, dst->data, src.length);
 }
 
 void string_trim_end(struct string* str, const unsigned char c)
@@ -203,532 +594,5212 @@ void string_destroy(struct string* str)
     str->data = NULL;
 }
 
-#define FSTREAM_BUFFER_INITIAL_CAPACITY 4 * 1024 * 1024
-
-struct fstream
+/**
+ * Compression formats of the input and the output. Each of them is available if the program is built with
+ * the corresponding library: -DWITH_ZLIB -lz, -DWITH_ZSTD -lzstd, -DWITH_LZ4 -llz4.
+ */
+enum compression
 {
-    void* buffer;
-    size_t buffer_capacity;
-    size_t buffer_size;
-    size_t buffer_offset;
-    int file;
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+    COMPRESSION_LZ4
 };
 
-struct fstream fstream_init(int file)
-{
-    struct fstream stream;
-    stream.buffer_capacity = FSTREAM_BUFFER_INITIAL_CAPACITY;
-    stream.buffer = malloc_or_fatal(stream.buffer_capacity);
-    stream.buffer_size = 0;
-    stream.buffer_offset = 0;
-    stream.file = file;
-    return stream;
-}
-
-void fstream_read_to_buffer(struct fstream* stream)
-{
-    stream->buffer_size = read(stream->file, stream->buffer, stream->buffer_capacity);
-    stream->buffer_offset = 0;
-}
+const char* compression_names[] = {"none", "gzip", "zstd", "lz4"};
 
-struct string fstream_read_line(struct fstream* stream, struct string* buffer, unsigned char delim)
+bool compression_supported(enum compression compression)
 {
-    size_t offset = 0;
-    if (stream->buffer_offset >= stream->buffer_size)
-        fstream_read_to_buffer(stream);
-    while (stream->buffer_size > 0)
+    switch (compression)
     {
-        void* delimptr = _memchr(stream->buffer + stream->buffer_offset, delim, stream->buffer_size - stream->buffer_offset);
-        size_t length = delimptr != NULL
-            ? delimptr - stream->buffer - stream->buffer_offset + 1
-            : stream->buffer_size - stream->buffer_offset;
-        string_expand(buffer, offset + length * 2);
-        memcpy(buffer->data + offset, stream->buffer + stream->buffer_offset, length);
-        stream->buffer_offset += length;
-        offset += length;
-        if (delimptr != NULL)
-            break;
-        if (stream->buffer_offset >= stream->buffer_size)
-            fstream_read_to_buffer(stream);
+    case COMPRESSION_NONE:
+        return true;
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        return true;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+        return true;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+        return true;
+#endif /* WITH_LZ4 */
+    default:
+        return false;
     }
-    return string_sub(*buffer, 0, offset);
-}
-
-void fstream_destroy(struct fstream* stream)
-{
-    free(stream->buffer);
-    stream->buffer = NULL;
 }
 
-#define BITMAP_WORD_BITS (sizeof(size_t) * 8)
+#define COMPRESSION_MAGIC_LENGTH 4
 
-void bitmap_set(size_t* bitmap, size_t idx)
+/**
+ * Recognizes the format by the magic bytes at the start of the data
+ */
+enum compression compression_detect(const unsigned char* data, size_t size)
 {
-    size_t idx_word = idx / BITMAP_WORD_BITS;
-    size_t mask = 1 << (idx % BITMAP_WORD_BITS);
-    bitmap[idx_word] |= mask;
+    if (size >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+        return COMPRESSION_GZIP;
+    if (size >= 4 && data[0] == 0x28 && data[1] == 0xB5 && data[2] == 0x2F && data[3] == 0xFD)
+        return COMPRESSION_ZSTD;
+    if (size >= 4 && data[0] == 0x04 && data[1] == 0x22 && data[2] == 0x4D && data[3] == 0x18)
+        return COMPRESSION_LZ4;
+    return COMPRESSION_NONE;
 }
 
-bool bitmap_get(size_t* bitmap, size_t idx)
+/**
+ * Returns true if the data may still be the start of the magic bytes of some format, so more of it is needed
+ */
+bool compression_magic_prefix(const unsigned char* data, size_t size)
 {
-    size_t idx_word = idx / BITMAP_WORD_BITS;
-    size_t mask = 1 << (idx % BITMAP_WORD_BITS);
-    return bitmap[idx_word] & mask;
+    static const unsigned char magics[][COMPRESSION_MAGIC_LENGTH] = {{0x1F, 0x8B}, {0x28, 0xB5, 0x2F, 0xFD}, {0x04, 0x22, 0x4D, 0x18}};
+    static const size_t lengths[] = {2, 4, 4};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        if (memcmp(data, magics[i], size < lengths[i] ? size : lengths[i]) == 0)
+            return true;
+    }
+    return false;
 }
 
-#define TRIE_INITIAL_CAPACITY 64 * 1024
-#define TRIE_NODE_SIZE sizeof(struct trie_node)
-#define TRIE_NULL_IDX SIZE_MAX
-#define TRIE_NODE_LINKED_LIST_CHUNKS 2
-#define TRIE_NODE_LINKED_LIST_MASK (TRIE_NODE_LINKED_LIST_CHUNKS - 1)
-#define TRIE_BITMAP_SIZE 4
-#define TRIE_BITMAP_MASK (BITMAP_WORD_BITS * TRIE_BITMAP_SIZE - 1)
-
-#define nextpow2(x) (((size_t)1) << (32 - __builtin_clz(x - 1)))
+#define DECODER_INPUT_CAPACITY 1024 * 1024
 
-struct trie_node
+/**
+ * Streaming decompressor. The compressed data is either a view of the entire file or is read from the file
+ * into the input buffer. Concatenated gzip members and zstd or lz4 frames are decoded one after another.
+ */
+struct decoder
 {
-    /**
-     * Index of the next character in the linked list. The linked list is split into chunks to increase scan performance.
-     */
-    size_t idx_next[TRIE_NODE_LINKED_LIST_CHUNKS];
-
-    /**
-     * Index of the first child node
-     */
-    size_t idx_child;
+    enum compression compression;
+    int file;
+    const unsigned char* input;
+    size_t input_size;
+    size_t input_offset;
+    bool input_eof;
 
     /**
-     * The bitmap acts as a fast-check filter to determine if a character may be present in the linked list.
-     * This is used only in the root of linked list.
+     * Owned input buffer, NULL if the input is a view
      */
-    size_t bitmap[TRIE_BITMAP_SIZE];
+    unsigned char* input_buffer;
 
     /**
-     * Stored character or \\0, if node is empty
-     */
-    unsigned char c;
-
-    /*
-     * If set, stored character is the last symbol in the keyword
+     * Set at the end of a member or a frame, the input must not end elsewhere
      */
-    bool leaf;
-} __attribute__((aligned(sizeof(size_t) * nextpow2(TRIE_NODE_LINKED_LIST_CHUNKS + TRIE_BITMAP_SIZE))));
+    bool frame_ended;
 
-struct
-{
-    struct trie_node* nodes;
-    size_t capacity;
-    size_t length;
-} trie;
+#ifdef WITH_ZLIB
+    z_stream zlib;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    ZSTD_DStream* zstd;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    LZ4F_dctx* lz4;
+#endif /* WITH_LZ4 */
+};
 
-size_t trie_node_add()
+/**
+ * Creates a decoder for the data of the given size. If view is set, the data is the entire input, otherwise
+ * it is the beginning of the input that has already been read from the file, and the rest is read as needed.
+ */
+struct decoder* decoder_init(enum compression compression, int file, const void* data, size_t size, bool view)
 {
-    if (trie.capacity <= trie.length)
+    struct decoder* decoder = malloc_or_fatal(sizeof(struct decoder));
+    memset(decoder, 0, sizeof(struct decoder));
+    decoder->compression = compression;
+    decoder->file = file;
+    if (view)
     {
-        trie.capacity *= 2;
-        trie.nodes = realloc_or_fatal(trie.nodes, trie.capacity * TRIE_NODE_SIZE);
+        decoder->input = data;
+        decoder->input_size = size;
+        decoder->input_eof = true;
+    }
+    else
+    {
+        decoder->input_buffer = malloc_or_fatal(size > DECODER_INPUT_CAPACITY ? size : DECODER_INPUT_CAPACITY);
+        memcpy(decoder->input_buffer, data, size);
+        decoder->input = decoder->input_buffer;
+        decoder->input_size = size;
     }
-    struct trie_node* node = &trie.nodes[trie.length];
-    memset(node, 0, TRIE_NODE_SIZE);
-    for (size_t i = 0; i < TRIE_NODE_LINKED_LIST_CHUNKS; i++)
-        node->idx_next[i] = TRIE_NULL_IDX;
-    node->idx_child = TRIE_NULL_IDX;
-    return trie.length++;
-}
-
-void trie_init()
-{
-    trie.capacity = TRIE_INITIAL_CAPACITY;
-    trie.nodes = malloc_or_fatal(trie.capacity * TRIE_NODE_SIZE);
-    trie.length = 0;
-    // Root node
-    trie_node_add();
-}
 
-size_t trie_linked_list_scan(size_t idx_first, unsigned char c)
-{
-    size_t chunk = c & TRIE_NODE_LINKED_LIST_MASK;
-    size_t idx = idx_first;
-    while (idx != TRIE_NULL_IDX)
+    switch (compression)
     {
-        if (trie.nodes[idx].c == c || trie.nodes[idx].idx_next[chunk] == TRIE_NULL_IDX)
-            return idx;
-        idx = trie.nodes[idx].idx_next[chunk];
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        // Window size with 16 added expects the gzip header and trailer
+        if (inflateInit2(&decoder->zlib, 15 + 16) != Z_OK)
+            fatal_nomem();
+        break;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+        decoder->zstd = ZSTD_createDStream();
+        if (decoder->zstd == NULL)
+            fatal_nomem();
+        ZSTD_initDStream(decoder->zstd);
+        break;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&decoder->lz4, LZ4F_VERSION)))
+            fatal_nomem();
+        break;
+#endif /* WITH_LZ4 */
+    default:
+        fatal("%s was built without %s support", PROGRAM_NAME, compression_names[compression]);
     }
-    return idx_first;
+    return decoder;
 }
 
-size_t trie_linked_list_add(size_t idx, unsigned char c)
+/**
+ * Passes the available input to the library. Returns the number of decompressed bytes written to dst.
+ */
+size_t decoder_step(struct decoder* decoder, void* dst, size_t capacity)
 {
-    size_t chunk = c & TRIE_NODE_LINKED_LIST_MASK;
-    size_t idx_new = trie_node_add();
-    trie.nodes[idx].idx_next[chunk] = idx_new;
-    return idx_new;
-}
+    const unsigned char* src = decoder->input + decoder->input_offset;
+    size_t src_size = decoder->input_size - decoder->input_offset;
+    size_t produced = 0;
 
-size_t trie_child_add(size_t idx)
-{
-    size_t idx_new = trie_node_add();
-    trie.nodes[idx].idx_child = idx_new;
-    return idx_new;
+    // Unused if the program is built without any compression library
+    (void)src;
+    (void)src_size;
+    (void)dst;
+    (void)capacity;
+    switch (decoder->compression)
+    {
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+    {
+        // The next member of a multi-member file starts with a new header
+        if (decoder->frame_ended)
+            inflateReset(&decoder->zlib);
+        decoder->zlib.next_in = (unsigned char*)src;
+        decoder->zlib.avail_in = src_size < UINT32_MAX ? src_size : UINT32_MAX;
+        decoder->zlib.next_out = dst;
+        decoder->zlib.avail_out = capacity < UINT32_MAX ? capacity : UINT32_MAX;
+        uInt avail_in = decoder->zlib.avail_in;
+        uInt avail_out = decoder->zlib.avail_out;
+        int result = inflate(&decoder->zlib, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            fatal("Invalid gzip input");
+        decoder->frame_ended = result == Z_STREAM_END;
+        decoder->input_offset += avail_in - decoder->zlib.avail_in;
+        produced = avail_out - decoder->zlib.avail_out;
+        break;
+    }
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+    {
+        ZSTD_inBuffer in = {src, src_size, 0};
+        ZSTD_outBuffer out = {dst, capacity, 0};
+        size_t result = ZSTD_decompressStream(decoder->zstd, &out, &in);
+        if (ZSTD_isError(result))
+            fatal("Invalid zstd input: %s", ZSTD_getErrorName(result));
+        decoder->frame_ended = result == 0;
+        decoder->input_offset += in.pos;
+        produced = out.pos;
+        break;
+    }
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+    {
+        size_t dst_size = capacity;
+        size_t result = LZ4F_decompress(decoder->lz4, dst, &dst_size, src, &src_size, NULL);
+        if (LZ4F_isError(result))
+            fatal("Invalid lz4 input: %s", LZ4F_getErrorName(result));
+        decoder->frame_ended = result == 0;
+        decoder->input_offset += src_size;
+        produced = dst_size;
+        break;
+    }
+#endif /* WITH_LZ4 */
+    default:
+        break;
+    }
+    return produced;
 }
 
-void trie_add(struct string str)
+/**
+ * Decompresses the next portion of the input into dst. Returns the number of bytes written, 0 at the end of the input.
+ */
+size_t decoder_read(struct decoder* decoder, void* dst, size_t capacity)
 {
-    size_t idx = 0;
     while (true)
     {
-        unsigned char c = str.data[0];
-
-        bitmap_set(trie.nodes[idx].bitmap, c & TRIE_BITMAP_MASK);
-
-        // Scan linked list inside the node
-        idx = trie_linked_list_scan(idx, c);
-        if (trie.nodes[idx].c == '\0')
-            // The linked list is empty (contains only an empty node)
-            trie.nodes[idx].c = c;
-        else if (trie.nodes[idx].c != c)
+        if (decoder->input_offset == decoder->input_size && !decoder->input_eof)
         {
-            // The symbol is not found in the node. Add to the linked list.
-            idx = trie_linked_list_add(idx, c);
-            trie.nodes[idx].c = c;
+            decoder->input_size = read_or_fatal(decoder->file, decoder->input_buffer, DECODER_INPUT_CAPACITY);
+            decoder->input_offset = 0;
+            decoder->input_eof = decoder->input_size == 0;
         }
-
-        if (str.length <= 1)
+        if (decoder->input_offset == decoder->input_size)
         {
-            trie.nodes[idx].leaf = true;
-            return;
+            if (!decoder->frame_ended)
+                fatal("Unexpected end of %s input", compression_names[decoder->compression]);
+            return 0;
         }
-        if (trie.nodes[idx].idx_child == TRIE_NULL_IDX)
-            trie_child_add(idx);
-
-        // Then go to the child node
-        idx = trie.nodes[idx].idx_child;
-        str = string_sub(str, 1, str.length - 1);
+        size_t input_offset = decoder->input_offset;
+        size_t produced = decoder_step(decoder, dst, capacity);
+        if (produced > 0)
+            return produced;
+        if (decoder->input_offset == input_offset)
+            fatal("Invalid %s input", compression_names[decoder->compression]);
     }
 }
 
-void trie_trim()
+void decoder_destroy(struct decoder* decoder)
 {
-    if (trie.length == trie.capacity)
-        return;
-    trie.capacity = trie.length;
-    struct trie_node* trimmed = malloc(TRIE_NODE_SIZE * trie.capacity);
-    if (trimmed != NULL)
+    switch (decoder->compression)
     {
-        memcpy(trimmed, trie.nodes, TRIE_NODE_SIZE * trie.capacity);
-        free(trie.nodes);
-        trie.nodes = trimmed;
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        inflateEnd(&decoder->zlib);
+        break;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+        ZSTD_freeDStream(decoder->zstd);
+        break;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+        LZ4F_freeDecompressionContext(decoder->lz4);
+        break;
+#endif /* WITH_LZ4 */
+    default:
+        break;
     }
-    else
-        trie.nodes = realloc_or_fatal(trie.nodes, TRIE_NODE_SIZE * trie.capacity);
+    free(decoder->input_buffer);
+    free(decoder);
 }
 
-size_t trie_match_str(struct string str)
-{
-    size_t idx = 0;
-    size_t i = 0;
-    while (true)
-    {
-        unsigned char c = str.data[i];
+/**
+ * Size of the pieces the data is compressed in, it bounds the output buffer of the encoder
+ */
+#define ENCODER_PIECE_SIZE 1024 * 1024
 
-        if (!bitmap_get(trie.nodes[idx].bitmap, c & TRIE_BITMAP_MASK))
-            return false;
+/**
+ * Streaming compressor of the output
+ */
+struct encoder
+{
+    enum compression compression;
+    unsigned char* output;
+    size_t output_capacity;
+    bool started;
 
-        // Scan linked list inside the node
-        idx = trie_linked_list_scan(idx, c);
-        struct trie_node node = trie.nodes[idx];
-        if (node.c != c)
-            return 0;
-        if (node.leaf)
-            return i + 1;
-        if (str.length - i <= 1)
-            return 0;
+#ifdef WITH_ZLIB
+    z_stream zlib;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    ZSTD_CCtx* zstd;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    LZ4F_cctx* lz4;
+#endif /* WITH_LZ4 */
+};
+
+/**
+ * Creates an encoder. zstd compresses on the given number of threads if the library supports it.
+ */
+struct encoder* encoder_init(enum compression compression, size_t threads_count)
+{
+    struct encoder* encoder = malloc_or_fatal(sizeof(struct encoder));
+    memset(encoder, 0, sizeof(struct encoder));
+    encoder->compression = compression;
+    encoder->output_capacity = ENCODER_PIECE_SIZE;
+
+    // Unused if the program is built without libzstd
+    (void)threads_count;
+    switch (compression)
+    {
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        if (deflateInit2(&encoder->zlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            fatal_nomem();
+        break;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+        encoder->zstd = ZSTD_createCCtx();
+        if (encoder->zstd == NULL)
+            fatal_nomem();
+        // Fails without effect if the library is built without multithreading
+        if (threads_count > 1)
+            ZSTD_CCtx_setParameter(encoder->zstd, ZSTD_c_nbWorkers, threads_count);
+        break;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+        if (LZ4F_isError(LZ4F_createCompressionContext(&encoder->lz4, LZ4F_VERSION)))
+            fatal_nomem();
+        encoder->output_capacity = LZ4F_compressBound(ENCODER_PIECE_SIZE, NULL) + LZ4F_HEADER_SIZE_MAX;
+        break;
+#endif /* WITH_LZ4 */
+    default:
+        fatal("%s was built without %s support", PROGRAM_NAME, compression_names[compression]);
+    }
+    encoder->output = malloc_or_fatal(encoder->output_capacity);
+    return encoder;
+}
+
+void encoder_write_piece(struct encoder* encoder, int file, const void* data, size_t size, bool finish)
+{
+    // Unused if the program is built without any compression library
+    (void)file;
+    (void)data;
+    (void)size;
+    (void)finish;
+    switch (encoder->compression)
+    {
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        encoder->zlib.next_in = (unsigned char*)data;
+        encoder->zlib.avail_in = size;
+        do
+        {
+            encoder->zlib.next_out = encoder->output;
+            encoder->zlib.avail_out = encoder->output_capacity;
+            deflate(&encoder->zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+            write_or_fatal(file, encoder->output, encoder->output_capacity - encoder->zlib.avail_out);
+        }
+        while (encoder->zlib.avail_out == 0);
+        break;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+    {
+        ZSTD_inBuffer in = {data, size, 0};
+        ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+        size_t remaining;
+        do
+        {
+            ZSTD_outBuffer out = {encoder->output, encoder->output_capacity, 0};
+            remaining = ZSTD_compressStream2(encoder->zstd, &out, &in, mode);
+            if (ZSTD_isError(remaining))
+                fatal("Failed to compress the output: %s", ZSTD_getErrorName(remaining));
+            write_or_fatal(file, encoder->output, out.pos);
+        }
+        while (finish ? remaining != 0 : in.pos < in.size);
+        break;
+    }
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+    {
+        size_t length;
+        if (!encoder->started)
+        {
+            length = LZ4F_compressBegin(encoder->lz4, encoder->output, encoder->output_capacity, NULL);
+            if (LZ4F_isError(length))
+                fatal("Failed to compress the output: %s", LZ4F_getErrorName(length));
+            write_or_fatal(file, encoder->output, length);
+            encoder->started = true;
+        }
+        length = finish
+            ? LZ4F_compressEnd(encoder->lz4, encoder->output, encoder->output_capacity, NULL)
+            : LZ4F_compressUpdate(encoder->lz4, encoder->output, encoder->output_capacity, data, size, NULL);
+        if (LZ4F_isError(length))
+            fatal("Failed to compress the output: %s", LZ4F_getErrorName(length));
+        write_or_fatal(file, encoder->output, length);
+        break;
+    }
+#endif /* WITH_LZ4 */
+    default:
+        break;
+    }
+}
+
+/**
+ * Compresses the data and writes the result to the file. If finish is set, the end of the stream is written after the data.
+ */
+void encoder_write(struct encoder* encoder, int file, const void* data, size_t size, bool finish)
+{
+    for (size_t offset = 0; offset < size; offset += ENCODER_PIECE_SIZE)
+    {
+        size_t length = size - offset < ENCODER_PIECE_SIZE ? size - offset : ENCODER_PIECE_SIZE;
+        encoder_write_piece(encoder, file, data + offset, length, false);
+    }
+    if (finish)
+        encoder_write_piece(encoder, file, NULL, 0, true);
+}
+
+void encoder_destroy(struct encoder* encoder)
+{
+    switch (encoder->compression)
+    {
+#ifdef WITH_ZLIB
+    case COMPRESSION_GZIP:
+        deflateEnd(&encoder->zlib);
+        break;
+#endif /* WITH_ZLIB */
+#ifdef WITH_ZSTD
+    case COMPRESSION_ZSTD:
+        ZSTD_freeCCtx(encoder->zstd);
+        break;
+#endif /* WITH_ZSTD */
+#ifdef WITH_LZ4
+    case COMPRESSION_LZ4:
+        LZ4F_freeCompressionContext(encoder->lz4);
+        break;
+#endif /* WITH_LZ4 */
+    default:
+        break;
+    }
+    free(encoder->output);
+    free(encoder);
+}
+
+#define FSTREAM_BUFFER_INITIAL_CAPACITY 4 * 1024 * 1024
+
+struct fstream
+{
+    void* buffer;
+    size_t buffer_capacity;
+    size_t buffer_size;
+    size_t buffer_offset;
+    int file;
+
+    /**
+     * If set, the buffer is a read-only view of the entire file
+     */
+    bool mapped;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif /* _WIN32 */
+
+    /**
+     * Decompressor of the file, NULL if it is not compressed. A mapped compressed file stays mapped as the view
+     * the decompressor reads from, and the stream is a buffered one.
+     */
+    struct decoder* decoder;
+    void* view;
+    size_t view_size;
+
+    /**
+     * If not 0, a line that does not fit into the buffer is returned in pieces of the buffer size instead of growing
+     * the buffer. Every further piece of the line starts with this many bytes of the end of the previous one.
+     */
+    size_t piece_overlap;
+
+    /**
+     * Number of bytes the buffered stream may still read from the file, SIZE_MAX if it reads to the end
+     */
+    size_t read_limit;
+
+    /**
+     * Set if the file is a regular one, reading it never waits for more data to arrive
+     */
+    bool regular;
+
+    /**
+     * Set by fstream_read_lines if the returned lines start with a further piece of a line or end in the middle of one
+     */
+    bool lines_continued;
+    bool lines_open;
+};
+
+struct fstream fstream_init(int file)
+{
+    struct fstream stream;
+    struct stat stat_buffer;
+    stream.regular = fstat(file, &stat_buffer) == 0 && S_ISREG(stat_buffer.st_mode);
+    stream.buffer_capacity = FSTREAM_BUFFER_INITIAL_CAPACITY;
+    stream.buffer = malloc_or_fatal(stream.buffer_capacity);
+    stream.buffer_size = 0;
+    stream.buffer_offset = 0;
+    stream.file = file;
+    stream.mapped = false;
+    stream.decoder = NULL;
+    stream.view = NULL;
+    stream.view_size = 0;
+    stream.piece_overlap = 0;
+    stream.read_limit = SIZE_MAX;
+    stream.lines_continued = false;
+    stream.lines_open = false;
+    return stream;
+}
+
+/**
+ * Maps a regular file of the given size into memory, so its lines can be sliced without any read() or copy.
+ * Falls back to the buffered stream if the file cannot be mapped.
+ */
+struct fstream fstream_init_mapped(int file, size_t size)
+{
+    struct fstream stream;
+    void* view = NULL;
+    if (size > 0)
+    {
+#ifdef _WIN32
+        stream.mapping = CreateFileMapping((HANDLE)_get_osfhandle(file), NULL, PAGE_READONLY, 0, 0, NULL);
+        if (stream.mapping != NULL)
+        {
+            view = MapViewOfFile(stream.mapping, FILE_MAP_READ, 0, 0, 0);
+            if (view == NULL)
+                CloseHandle(stream.mapping);
+        }
+#else /* _WIN32 */
+        view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (view == MAP_FAILED)
+            view = NULL;
+        else
+            madvise(view, size, MADV_SEQUENTIAL);
+#endif /* _WIN32 */
+    }
+    if (view == NULL)
+        return fstream_init(file);
+    stream.buffer = view;
+    stream.buffer_capacity = size;
+    stream.buffer_size = size;
+    stream.buffer_offset = 0;
+    stream.file = file;
+    stream.mapped = true;
+    stream.regular = true;
+    stream.decoder = NULL;
+    stream.view = NULL;
+    stream.view_size = 0;
+    stream.piece_overlap = 0;
+    stream.read_limit = SIZE_MAX;
+    stream.lines_continued = false;
+    stream.lines_open = false;
+    return stream;
+}
+
+/**
+ * Checks the magic bytes at the start of the file and, if it is compressed, makes the stream decompress it.
+ * A compressed stream is always buffered, so the pool reads ahead and decompression runs in parallel with matching.
+ */
+void fstream_detect_compression(struct fstream* stream)
+{
+    enum compression compression;
+    if (stream->mapped)
+    {
+        compression = compression_detect(stream->buffer, stream->buffer_size);
+        if (compression == COMPRESSION_NONE)
+            return;
+        stream->view = stream->buffer;
+        stream->view_size = stream->buffer_size;
+        stream->decoder = decoder_init(compression, stream->file, stream->view, stream->view_size, true);
+        stream->mapped = false;
+        stream->buffer_capacity = FSTREAM_BUFFER_INITIAL_CAPACITY;
+        stream->buffer = malloc_or_fatal(stream->buffer_capacity);
+        stream->buffer_size = 0;
+        stream->buffer_offset = 0;
+        return;
+    }
+
+    // Reads from a pipe may return fewer bytes than the magic. They are waited for only while they may turn out
+    // to be the magic, so a short first line of a pipe is matched without waiting for the next one.
+    while (stream->buffer_size < COMPRESSION_MAGIC_LENGTH && compression_magic_prefix(stream->buffer, stream->buffer_size))
+    {
+        size_t count = read_or_fatal(stream->file, stream->buffer + stream->buffer_size, stream->buffer_capacity - stream->buffer_size);
+        if (count == 0)
+            break;
+        stream->buffer_size += count;
+    }
+    compression = compression_detect(stream->buffer, stream->buffer_size);
+    if (compression == COMPRESSION_NONE)
+        return;
+    stream->decoder = decoder_init(compression, stream->file, stream->buffer, stream->buffer_size, false);
+    stream->buffer_size = 0;
+}
+
+/**
+ * Appends data from the file to the end of the buffer. Returns false if the file is over.
+ */
+bool fstream_read_to_buffer(struct fstream* stream)
+{
+    if (stream->mapped)
+        return false;
+    if (stream->buffer_size == stream->buffer_capacity)
+    {
+        stream->buffer_capacity *= 2;
+        stream->buffer = realloc_or_fatal(stream->buffer, stream->buffer_capacity);
+    }
+    size_t capacity = stream->buffer_capacity - stream->buffer_size;
+    if (capacity > stream->read_limit)
+        capacity = stream->read_limit;
+    size_t count = stream->decoder != NULL
+        ? decoder_read(stream->decoder, stream->buffer + stream->buffer_size, capacity)
+        : (size_t)read_or_fatal(stream->file, stream->buffer + stream->buffer_size, capacity);
+    stream->buffer_size += count;
+    stream->read_limit -= count;
+    return count > 0;
+}
+
+/**
+ * Moves the unread tail to the start of the buffer to make room for the next read
+ */
+void fstream_compact(struct fstream* stream)
+{
+    if (stream->buffer_offset == 0 || stream->mapped)
+        return;
+    memmove(stream->buffer, stream->buffer + stream->buffer_offset, stream->buffer_size - stream->buffer_offset);
+    stream->buffer_size -= stream->buffer_offset;
+    stream->buffer_offset = 0;
+}
+
+/**
+ * Fills the buffer and returns all complete lines in it. Instead of copying the lines, the buffer that holds them
+ * is handed over to the caller, and the stream continues with the spare buffer. Only the incomplete last line
+ * is copied there. An empty string is returned at the end of the file. A mapped file is cut into pieces
+ * at line boundaries regardless of the length of the lines, since the view takes no memory of its own.
+ */
+struct string fstream_read_lines(struct fstream* stream, struct string* spare, unsigned char delim)
+{
+    if (stream->mapped)
+    {
+        // No buffers to exchange, just cut the next piece of the view at a line boundary
+        void* lines_start = stream->buffer + stream->buffer_offset;
+        size_t available = stream->buffer_size - stream->buffer_offset;
+        size_t length = available;
+        if (length > FSTREAM_BUFFER_INITIAL_CAPACITY)
+        {
+            void* delimptr = _memchr(lines_start + FSTREAM_BUFFER_INITIAL_CAPACITY, delim, available - FSTREAM_BUFFER_INITIAL_CAPACITY);
+            if (delimptr != NULL)
+                length = delimptr - lines_start + 1;
+        }
+        stream->buffer_offset += length;
+#if !defined(_WIN32) && defined(MADV_WILLNEED)
+        // Ask the kernel to start reading the next piece while the lines of this one are being matched
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t next_offset = stream->buffer_offset / page_size * page_size;
+        size_t next_length = stream->buffer_size - next_offset;
+        if (next_length > FSTREAM_BUFFER_INITIAL_CAPACITY)
+            next_length = FSTREAM_BUFFER_INITIAL_CAPACITY;
+        if (next_length > 0)
+            madvise(stream->buffer + next_offset, next_length, MADV_WILLNEED);
+#endif /* !defined(_WIN32) && defined(MADV_WILLNEED) */
+        return (struct string) {lines_start, length};
+    }
+
+    // A regular file is read until the buffer is full. Other files return the complete lines as soon as a read
+    // has brought any, so the lines of a pipe are matched when they arrive.
+    bool eof = false;
+    bool piece = false;
+    bool found = false;
+    size_t searched = 0;
+    fstream_compact(stream);
+    while (true)
+    {
+        found = found || _memchr(stream->buffer + searched, delim, stream->buffer_size - searched) != NULL;
+        searched = stream->buffer_size;
+        if (found && (!stream->regular || stream->buffer_size == stream->buffer_capacity))
+            break;
+
+        // The buffer is full and holds no line break. It grows only until the pieces advance by the overlap at least.
+        piece = !found && stream->piece_overlap > 0 && stream->buffer_size == stream->buffer_capacity
+            && stream->buffer_capacity >= 2 * stream->piece_overlap;
+        if (piece)
+            break;
+        if (!fstream_read_to_buffer(stream))
+        {
+            eof = true;
+            break;
+        }
+    }
+
+    size_t length = stream->buffer_size;
+    if (!eof && !piece)
+    {
+        while (((unsigned char*)stream->buffer)[length - 1] != delim)
+            length--;
+    }
+
+    // The overlap of a piece is both returned and kept as the start of the next piece
+    size_t tail_start = piece ? length - stream->piece_overlap : length;
+    size_t tail_length = stream->buffer_size - tail_start;
+    string_expand(spare, stream->buffer_capacity);
+    memcpy(spare->data, stream->buffer + tail_start, tail_length);
+    struct string lines = {stream->buffer, length};
+    size_t lines_capacity = stream->buffer_capacity;
+    stream->buffer = spare->data;
+    stream->buffer_capacity = spare->length;
+    stream->buffer_size = tail_length;
+    spare->data = lines.data;
+    spare->length = lines_capacity;
+    stream->lines_continued = stream->lines_open;
+    stream->lines_open = piece;
+    return lines;
+}
+
+void fstream_destroy(struct fstream* stream)
+{
+    if (stream->mapped)
+    {
+        stream->view = stream->buffer;
+        stream->view_size = stream->buffer_capacity;
+    }
+    else
+        free(stream->buffer);
+    if (stream->view != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(stream->view);
+        CloseHandle(stream->mapping);
+#else /* _WIN32 */
+        munmap(stream->view, stream->view_size);
+#endif /* _WIN32 */
+    }
+    if (stream->decoder != NULL)
+        decoder_destroy(stream->decoder);
+    stream->buffer = NULL;
+    stream->view = NULL;
+    stream->decoder = NULL;
+}
+
+#define OSTREAM_BUFFER_DEFAULT_CAPACITY 4 * 1024 * 1024
+
+/**
+ * Output counterpart of fstream. Collects small writes in memory and passes them to the file in large blocks.
+ * With a writer thread, a full buffer is written in the background while the writes go to the spare one.
+ */
+struct ostream
+{
+    void* buffer;
+    size_t buffer_capacity;
+    size_t buffer_size;
+    int file;
+
+    bool async;
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /**
+     * Buffer handed over to the writer thread and the number of bytes in it that are not written yet
+     */
+    void* spare;
+    size_t spare_size;
+
+    bool stopped;
+
+    /**
+     * Compressor of the output, NULL if the output is written as is
+     */
+    struct encoder* encoder;
+
+    /**
+     * Set if the file is a terminal, a pipe or anything else but a regular file. Such an output is flushed
+     * with ostream_flush_interactive() after every chunk of the input, so the lines are seen as they are found.
+     */
+    bool interactive;
+};
+
+struct ostream ostream_init(int file, size_t capacity)
+{
+    struct ostream stream;
+    struct stat stat_buffer;
+    stream.buffer_capacity = capacity;
+    stream.buffer = malloc_or_fatal(stream.buffer_capacity);
+    stream.buffer_size = 0;
+    stream.file = file;
+    stream.interactive = fstat(file, &stat_buffer) < 0 || !S_ISREG(stat_buffer.st_mode);
+    stream.async = false;
+    stream.spare = NULL;
+    stream.spare_size = 0;
+    stream.stopped = false;
+    stream.encoder = NULL;
+    return stream;
+}
+
+/**
+ * Passes the data to the file, through the compressor if there is one
+ */
+void ostream_write_file(struct ostream* stream, const void* buf, size_t count)
+{
+    if (stream->encoder != NULL)
+        encoder_write(stream->encoder, stream->file, buf, count, false);
+    else
+        write_or_fatal(stream->file, buf, count);
+}
+
+void* ostream_writer(void* arg)
+{
+    struct ostream* stream = arg;
+    pthread_mutex_lock(&stream->mutex);
+    while (true)
+    {
+        while (stream->spare_size == 0 && !stream->stopped)
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+        if (stream->spare_size == 0)
+            break;
+        pthread_mutex_unlock(&stream->mutex);
+        ostream_write_file(stream, stream->spare, stream->spare_size);
+        pthread_mutex_lock(&stream->mutex);
+        stream->spare_size = 0;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+/**
+ * Starts the writer thread. The stream must not be moved afterwards.
+ */
+void ostream_start_writer(struct ostream* stream)
+{
+    stream->spare = malloc_or_fatal(stream->buffer_capacity);
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->async = true;
+    if (pthread_create(&stream->writer, NULL, ostream_writer, stream) != 0)
+        fatal("Failed to create a thread");
+}
+
+/**
+ * Waits until the writer thread has written the spare buffer
+ */
+void ostream_wait(struct ostream* stream)
+{
+    if (!stream->async)
+        return;
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->spare_size > 0)
+        pthread_cond_wait(&stream->cond, &stream->mutex);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+void ostream_flush(struct ostream* stream)
+{
+    if (!stream->async)
+    {
+        ostream_write_file(stream, stream->buffer, stream->buffer_size);
+        stream->buffer_size = 0;
+        return;
+    }
+    if (stream->buffer_size == 0)
+        return;
+    ostream_wait(stream);
+    void* full = stream->buffer;
+    stream->buffer = stream->spare;
+    pthread_mutex_lock(&stream->mutex);
+    stream->spare = full;
+    stream->spare_size = stream->buffer_size;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+    stream->buffer_size = 0;
+}
+
+/**
+ * Flushes the buffer if the output is interactive. A regular file keeps collecting the writes into large blocks.
+ */
+void ostream_flush_interactive(struct ostream* stream)
+{
+    if (stream->interactive && stream->buffer_size > 0)
+        ostream_flush(stream);
+}
+
+void ostream_write(struct ostream* stream, const void* buf, size_t count)
+{
+    if (stream->buffer_size + count > stream->buffer_capacity)
+        ostream_flush(stream);
+    if (count >= stream->buffer_capacity)
+    {
+        // Copying would not save any system call
+        ostream_wait(stream);
+        ostream_write_file(stream, buf, count);
+        return;
+    }
+    memcpy(stream->buffer + stream->buffer_size, buf, count);
+    stream->buffer_size += count;
+}
+
+void ostream_destroy(struct ostream* stream)
+{
+    ostream_flush(stream);
+    if (stream->async)
+    {
+        pthread_mutex_lock(&stream->mutex);
+        stream->stopped = true;
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+        pthread_join(stream->writer, NULL);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+        free(stream->spare);
+        stream->spare = NULL;
+    }
+    if (stream->encoder != NULL)
+    {
+        encoder_write(stream->encoder, stream->file, NULL, 0, true);
+        encoder_destroy(stream->encoder);
+        stream->encoder = NULL;
+    }
+    free(stream->buffer);
+    stream->buffer = NULL;
+}
+
+#define BITMAP_WORD_BITS (sizeof(uint64_t) * 8)
+
+void bitmap_set(uint64_t* bitmap, size_t idx)
+{
+    size_t idx_word = idx / BITMAP_WORD_BITS;
+    uint64_t mask = (uint64_t)1 << (idx % BITMAP_WORD_BITS);
+    bitmap[idx_word] |= mask;
+}
+
+bool bitmap_get(const uint64_t* bitmap, size_t idx)
+{
+    size_t idx_word = idx / BITMAP_WORD_BITS;
+    uint64_t mask = (uint64_t)1 << (idx % BITMAP_WORD_BITS);
+    return bitmap[idx_word] & mask;
+}
+
+#define TRIE_INITIAL_CAPACITY 64 * 1024
+#define TRIE_NODE_SIZE sizeof(struct trie_node)
+#define TRIE_NULL_IDX UINT32_MAX
+#define TRIE_MAX_LENGTH (TRIE_NULL_IDX - 1)
+#define TRIE_NODE_LINKED_LIST_CHUNKS 2
+#define TRIE_NODE_LINKED_LIST_MASK (TRIE_NODE_LINKED_LIST_CHUNKS - 1)
+#define TRIE_BITMAP_SIZE 4
+#define TRIE_BITMAP_MASK (BITMAP_WORD_BITS * TRIE_BITMAP_SIZE - 1)
+#define TRIE_DENSE_MAX_DEPTH 4
+#define TRIE_DENSE_MIN_FANOUT 16
+#define TRIE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct trie_node
+{
+    /**
+     * Index of the next character in the linked list. The linked list is split into chunks to increase scan performance.
+     */
+    uint32_t idx_next[TRIE_NODE_LINKED_LIST_CHUNKS];
+
+    /**
+     * Index of the first child node
+     */
+    uint32_t idx_child;
+
+    /**
+     * Index of the bitmap in trie.bitmaps, or TRIE_NULL_IDX. Only the first node of a linked list that holds
+     * more than one character has a bitmap. If the dense flag is set, it is an index of the transition table
+     * in trie.tables instead.
+     */
+    uint32_t idx_filter;
+
+    /**
+     * Stored character or \0, if node is empty
+     */
+    unsigned char c;
+
+    /*
+     * If set, stored character is the last symbol in the keyword
+     */
+    bool leaf;
+
+    /*
+     * If set, the linked list is replaced by a transition table. Used only in the root of linked list.
+     */
+    bool dense;
+};
+
+/**
+ * The bitmap acts as a fast-check filter to determine if a character is present in the linked list
+ */
+struct trie_bitmap
+{
+    uint64_t words[TRIE_BITMAP_SIZE];
+};
+
+/**
+ * Direct mapping "char -> node" for the linked lists of the upper levels, where the fan-out is high and scanning
+ * a linked list would take too many hops
+ */
+struct trie_table
+{
+    uint32_t idx[TRIE_BITMAP_MASK + 1];
+};
+
+#define PREFILTER_MAX_LENGTH 3
+#define PREFILTER_BUCKETS 8
+#define PREFILTER_MAX_CANDIDATE_RATE 0.25
+
+/**
+ * Teddy-style fingerprint of the first bytes of all keywords. Each keyword prefix is put into one of 8 buckets,
+ * and for every byte of the prefix the buckets are recorded in two 16-entry tables indexed by low and high nibbles.
+ * A position may start a keyword only if some bucket is present in all tables for all bytes of the fingerprint.
+ * The tables fit into SIMD registers, so 16 positions are tested at once with a few shuffles.
+ */
+struct prefilter
+{
+    unsigned char lo[PREFILTER_MAX_LENGTH][16] __attribute__((aligned(16)));
+    unsigned char hi[PREFILTER_MAX_LENGTH][16] __attribute__((aligned(16)));
+
+    /**
+     * Number of bytes in the fingerprint, or 0 if the prefilter is disabled
+     */
+    size_t length;
+
+    /**
+     * Estimated fraction of the offsets of a random text that pass, reported by --explain
+     */
+    double candidate_rate;
+};
+
+__attribute__((always_inline))
+static inline bool prefilter_test(const struct prefilter* prefilter, const unsigned char* data)
+{
+    unsigned char buckets = 0xFF;
+    for (size_t k = 0; k < prefilter->length; k++)
+        buckets &= prefilter->lo[k][data[k] & 0x0F] & prefilter->hi[k][data[k] >> 4];
+    return buckets != 0;
+}
+
+/**
+ * Tests the offsets one by one. It is inlined into every SIMD version for the tail: a call from AVX code into
+ * a kernel compiled with legacy SSE encoding costs more than the tail itself on lines of a few hundred bytes.
+ */
+__attribute__((always_inline))
+static inline size_t prefilter_find_tail(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end)
+{
+    for (; offset < end; offset++)
+    {
+        if (prefilter_test(prefilter, data + offset))
+            return offset;
+    }
+    return end;
+}
+
+size_t prefilter_find_scalar(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end)
+{
+    return prefilter_find_tail(prefilter, data, offset, end);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("ssse3")))
+size_t prefilter_find_ssse3(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end)
+{
+    __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    __m128i zero = _mm_setzero_si128();
+    for (; offset + 16 <= end; offset += 16)
+    {
+        __m128i buckets = _mm_set1_epi8(0xFF);
+        for (size_t k = 0; k < prefilter->length; k++)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i*)(data + offset + k));
+            __m128i lo = _mm_and_si128(block, nibble_mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(block, 4), nibble_mask);
+            buckets = _mm_and_si128(buckets, _mm_shuffle_epi8(_mm_load_si128((const __m128i*)prefilter->lo[k]), lo));
+            buckets = _mm_and_si128(buckets, _mm_shuffle_epi8(_mm_load_si128((const __m128i*)prefilter->hi[k]), hi));
+        }
+        int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, zero)) & 0xFFFF;
+        if (mask != 0)
+            return offset + __builtin_ctz(mask);
+    }
+    return prefilter_find_tail(prefilter, data, offset, end);
+}
+
+/**
+ * Shuffles work within 128-bit lanes, so the tables are broadcast to every lane
+ */
+__attribute__((target("avx2")))
+size_t prefilter_find_avx2(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end)
+{
+    __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i tables_lo[PREFILTER_MAX_LENGTH];
+    __m256i tables_hi[PREFILTER_MAX_LENGTH];
+    for (size_t k = 0; k < prefilter->length; k++)
+    {
+        tables_lo[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)prefilter->lo[k]));
+        tables_hi[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)prefilter->hi[k]));
+    }
+    for (; offset + 32 <= end; offset += 32)
+    {
+        __m256i buckets = _mm256_set1_epi8(0xFF);
+        for (size_t k = 0; k < prefilter->length; k++)
+        {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(data + offset + k));
+            __m256i lo = _mm256_and_si256(block, nibble_mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble_mask);
+            buckets = _mm256_and_si256(buckets, _mm256_shuffle_epi8(tables_lo[k], lo));
+            buckets = _mm256_and_si256(buckets, _mm256_shuffle_epi8(tables_hi[k], hi));
+        }
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(buckets, zero));
+        if (mask != 0)
+            return offset + __builtin_ctz(mask);
+    }
+    return prefilter_find_tail(prefilter, data, offset, end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t prefilter_find_avx512(const struct prefilter* prefilter, const unsigned char* data, size_t offset, size_t end)
+{
+    __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+    __m512i tables_lo[PREFILTER_MAX_LENGTH];
+    __m512i tables_hi[PREFILTER_MAX_LENGTH];
+    for (size_t k = 0; k < prefilter->length; k++)
+    {
+        tables_lo[k] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)prefilter->lo[k]));
+        tables_hi[k] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)prefilter->hi[k]));
+    }
+    for (; offset + 64 <= end; offset += 64)
+    {
+        __m512i buckets = _mm512_set1_epi8(0xFF);
+        for (size_t k = 0; k < prefilter->length; k++)
+        {
+            __m512i block = _mm512_loadu_si512(data + offset + k);
+            __m512i lo = _mm512_and_si512(block, nibble_mask);
+            __m512i hi = _mm512_and_si512(_mm512_srli_epi16(block, 4), nibble_mask);
+            buckets = _mm512_and_si512(buckets, _mm512_shuffle_epi8(tables_lo[k], lo));
+            buckets = _mm512_and_si512(buckets, _mm512_shuffle_epi8(tables_hi[k], hi));
+        }
+        uint64_t mask = _mm512_test_epi8_mask(buckets, buckets);
+        if (mask != 0)
+            return offset + __builtin_ctzll(mask);
+    }
+    return prefilter_find_tail(prefilter, data, offset, end);
+}
+#endif /* SIMD_X86 */
+
+/**
+ * The estimate of trie_build_prefilter() assumes a random text. In a real one the keyword prefixes may be
+ * frequent, and if a call skips only a few bytes, it costs more than the walks it saves. Every thread measures
+ * the bytes skipped over its last calls and stops using the prefilter while they are too few, then tries it again.
+ */
+#define PREFILTER_SAMPLE_CALLS 4096
+#define PREFILTER_MIN_SKIP 8
+#define PREFILTER_RETRY_CALLS (1024 * 1024)
+
+static _Thread_local struct
+{
+    size_t calls;
+    size_t skipped;
+    bool disabled;
+} prefilter_local;
+
+/**
+ * Returns the first offset, starting from the given one, where a keyword may start, or the length of the string
+ */
+size_t prefilter_find(const struct prefilter* prefilter, struct string str, size_t offset)
+{
+    if (prefilter->length == 0)
+        return offset;
+    if (prefilter_local.disabled)
+    {
+        if (++prefilter_local.calls < PREFILTER_RETRY_CALLS)
+            return offset;
+        prefilter_local.disabled = false;
+        prefilter_local.calls = 0;
+        prefilter_local.skipped = 0;
+    }
+    if (str.length < prefilter->length)
+        return str.length;
+    size_t end = str.length - prefilter->length + 1;
+    size_t found = simd.prefilter_find(prefilter, str.data, offset, end);
+    found = found < end ? found : str.length;
+    prefilter_local.skipped += found - offset;
+    if (++prefilter_local.calls == PREFILTER_SAMPLE_CALLS)
+    {
+        prefilter_local.disabled = prefilter_local.skipped < PREFILTER_SAMPLE_CALLS * PREFILTER_MIN_SKIP;
+        prefilter_local.calls = 0;
+        prefilter_local.skipped = 0;
+    }
+    return found;
+}
+
+/**
+ * Detects the instruction sets supported by the CPU and selects the kernels for the best one, but not above
+ * max_level. Must be called before any worker thread starts and after the lowercase mapping is built.
+ */
+void simd_init(enum simd_level max_level)
+{
+    enum simd_level level = SIMD_LEVEL_SCALAR;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        level = SIMD_LEVEL_SSE2;
+    if (level == SIMD_LEVEL_SSE2 && __builtin_cpu_supports("ssse3"))
+        level = SIMD_LEVEL_SSSE3;
+    if (level == SIMD_LEVEL_SSSE3 && __builtin_cpu_supports("avx2"))
+        level = SIMD_LEVEL_AVX2;
+    if (level == SIMD_LEVEL_AVX2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        level = SIMD_LEVEL_AVX512;
+#endif /* SIMD_X86 */
+    if (level > max_level)
+        level = max_level;
+
+    simd.level = level;
+    simd.memchr = memchr_scalar;
+    simd.to_lower = string_to_lower_scalar;
+    simd.prefilter_find = prefilter_find_scalar;
+    simd.memmem = memmem_scalar;
+#ifdef SIMD_X86
+    // The SIMD kernels know only about ASCII letters, other locales keep the lookup
+    bool lower_ascii = string_lower_lookup_is_ascii();
+    switch (level)
+    {
+    case SIMD_LEVEL_AVX512:
+        simd.memchr = memchr_avx512;
+        simd.to_lower = lower_ascii ? string_to_lower_avx512 : string_to_lower_scalar;
+        simd.prefilter_find = prefilter_find_avx512;
+        simd.memmem = memmem_avx2;
+        break;
+
+    case SIMD_LEVEL_AVX2:
+        simd.memchr = memchr_avx2;
+        simd.to_lower = lower_ascii ? string_to_lower_avx2 : string_to_lower_scalar;
+        simd.prefilter_find = prefilter_find_avx2;
+        simd.memmem = memmem_avx2;
+        break;
+
+    case SIMD_LEVEL_SSSE3:
+        simd.prefilter_find = prefilter_find_ssse3;
+        __attribute__((fallthrough));
+    case SIMD_LEVEL_SSE2:
+        simd.memchr = memchr_sse2;
+        simd.to_lower = lower_ascii ? string_to_lower_sse2 : string_to_lower_scalar;
+        simd.memmem = memmem_sse2;
+        break;
+
+    default:
+        break;
+    }
+#endif /* SIMD_X86 */
+}
+
+/**
+ * A node that is neither a leaf nor has children can only be the root of an empty trie
+ */
+#define trie_node_is_empty(node) (!(node).leaf && (node).idx_child == TRIE_NULL_IDX)
+
+enum trie_engine
+{
+    /**
+     * Restart the trie walk from every offset of the line
+     */
+    TRIE_ENGINE_TRIE,
+
+    /**
+     * Follow failure links to scan the line in a single pass
+     */
+    TRIE_ENGINE_AHO_CORASICK,
+
+    /**
+     * Search for the only keyword with simd.memmem(), the trie is not walked
+     */
+    TRIE_ENGINE_MEMMEM,
+
+    /**
+     * Replaced with one of the above by trie_select_engine()
+     */
+    TRIE_ENGINE_AUTO
+};
+
+const char* trie_engine_names[] = {"trie", "aho-corasick", "memmem", "auto"};
+
+struct trie_index
+{
+    struct trie_node* nodes;
+    size_t capacity;
+    size_t length;
+    enum trie_engine engine;
+
+    /**
+     * If set, the keywords are stored in lowercase and the input is folded byte by byte during the walk
+     */
+    bool case_insensitive;
+
+    struct trie_bitmap* bitmaps;
+    size_t bitmaps_capacity;
+    size_t bitmaps_length;
+
+    struct trie_table* tables;
+    size_t tables_length;
+
+    /**
+     * Aho-Corasick failure links, one per node. Points to the node that represents the longest proper suffix
+     * of the current node's keyword prefix, or TRIE_NULL_IDX for the root.
+     */
+    uint32_t* idx_fail;
+
+    /**
+     * Aho-Corasick output links, one per node. Points to the nearest leaf reachable through failure links,
+     * or TRIE_NULL_IDX if there is none.
+     */
+    uint32_t* idx_output;
+
+    /**
+     * Length of the keyword prefix ending at the node
+     */
+    uint32_t* depth;
+
+    /**
+     * If set, the node and automaton arrays are allocated by trie_array_alloc() with huge page backing
+     */
+    bool huge_pages;
+
+    /**
+     * If set, all the arrays above are views of an index file and must not be freed
+     */
+    bool loaded;
+    bool automaton_loaded;
+    struct fstream index_stream;
+
+    struct prefilter prefilter;
+
+    /**
+     * Keywords dropped by trie_build because they repeat a previous one or a shorter keyword is their prefix,
+     * and the number of nodes the latter would take
+     */
+    size_t duplicates_count;
+    size_t pruned_count;
+    size_t pruned_nodes;
+
+    /**
+     * Length of the longest keyword in the trie
+     */
+    size_t max_length;
+
+    /**
+     * Byte that ends the keywords of a file and the lines of the input, it is not a part of a match
+     */
+    unsigned char delimiter;
+
+    /**
+     * If set, the end of a line is matched as is. The library sets it, its buffers are not lines of a file.
+     */
+    bool keep_line_end;
+
+    /**
+     * The only keyword, restored from the trie for the memmem engine
+     */
+    struct string keyword;
+};
+
+/**
+ * Index the calling thread works with, the functions below refer to it as trie. Every thread starts with the default one.
+ * A connection of the server makes the index it was accepted with current, and so does a call of the library
+ * with the index of its matcher.
+ */
+struct trie_index trie_default;
+static _Thread_local struct trie_index* trie_current = &trie_default;
+#define trie (*trie_current)
+
+uint32_t trie_bitmap_add()
+{
+    if (trie.bitmaps_capacity <= trie.bitmaps_length)
+    {
+        trie.bitmaps_capacity = trie.bitmaps_capacity > 0 ? trie.bitmaps_capacity * 2 : TRIE_INITIAL_CAPACITY;
+        trie.bitmaps = realloc_or_fatal(trie.bitmaps, trie.bitmaps_capacity * sizeof(struct trie_bitmap));
+    }
+    memset(&trie.bitmaps[trie.bitmaps_length], 0, sizeof(struct trie_bitmap));
+    return trie.bitmaps_length++;
+}
+
+/**
+ * The node and automaton arrays take most of the memory of a large trie, and random hops over them miss the TLB
+ * all the time. With huge pages enabled they are mapped separately from the heap: from the reserved huge pages
+ * if there are any, otherwise from regular pages that the kernel is asked to merge into transparent huge pages.
+ */
+void* trie_array_alloc(size_t size)
+{
+    if (!trie.huge_pages)
+        return malloc_or_fatal(size);
+#ifdef _WIN32
+    // Large pages on Windows require a privilege that regular users do not have
+    return malloc_or_fatal(size);
+#else /* _WIN32 */
+    size = (size + TRIE_HUGE_PAGE_SIZE - 1) / TRIE_HUGE_PAGE_SIZE * TRIE_HUGE_PAGE_SIZE;
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif /* MAP_HUGETLB */
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            fatal_nomem();
+#ifdef MADV_HUGEPAGE
+        madvise(memory, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    }
+    return memory;
+#endif /* _WIN32 */
+}
+
+void trie_array_free(void* memory, size_t size)
+{
+    if (memory == NULL)
+        return;
+#ifndef _WIN32
+    if (trie.huge_pages)
+    {
+        munmap(memory, (size + TRIE_HUGE_PAGE_SIZE - 1) / TRIE_HUGE_PAGE_SIZE * TRIE_HUGE_PAGE_SIZE);
+        return;
+    }
+#endif /* _WIN32 */
+    free(memory);
+}
+
+void trie_init(enum trie_engine engine, bool case_insensitive, bool huge_pages, unsigned char delimiter)
+{
+    trie.nodes = NULL;
+    trie.capacity = 0;
+    trie.length = 0;
+    trie.engine = engine;
+    trie.case_insensitive = case_insensitive;
+    trie.huge_pages = huge_pages;
+    trie.bitmaps = NULL;
+    trie.bitmaps_capacity = 0;
+    trie.bitmaps_length = 0;
+    trie.tables = NULL;
+    trie.tables_length = 0;
+    trie.idx_fail = NULL;
+    trie.idx_output = NULL;
+    trie.depth = NULL;
+    trie.loaded = false;
+    trie.automaton_loaded = false;
+    trie.duplicates_count = 0;
+    trie.pruned_count = 0;
+    trie.pruned_nodes = 0;
+    trie.max_length = 0;
+    trie.delimiter = delimiter;
+    trie.keep_line_end = false;
+    trie.keyword = string_init();
+}
+
+/**
+ * Drops the delimiter that ends the line, and the carriage returns before a line feed
+ */
+static inline void trie_trim_line(struct string* str)
+{
+    if (trie.keep_line_end)
+        return;
+    string_trim_end(str, trie.delimiter);
+    if (trie.delimiter == '\n')
+        string_trim_end(str, '\r');
+}
+
+/**
+ * Counters of a run, printed with --stats. Every thread updates its own copy, which is added to the total
+ * when the thread finishes. The matching functions take the flag track as a constant, like fold, so the
+ * specializations used without --stats do not touch the counters at all.
+ */
+struct stats_counters
+{
+    size_t bytes;
+    size_t lines;
+    size_t lines_matched;
+
+    /**
+     * Walks of the trie started from the root
+     */
+    size_t walks;
+
+    /**
+     * Lookups of a character among the children of a node
+     */
+    size_t hops;
+
+    size_t bitmap_rejected;
+    size_t bitmap_passed;
+
+    double read_seconds;
+    double match_seconds;
+    double write_seconds;
+};
+
+struct
+{
+    bool enabled;
+    struct stats_counters total;
+    pthread_mutex_t mutex;
+} stats;
+
+static _Thread_local struct stats_counters stats_local;
+
+void stats_init(bool enabled)
+{
+    memset(&stats.total, 0, sizeof(struct stats_counters));
+    stats.enabled = enabled;
+    pthread_mutex_init(&stats.mutex, NULL);
+}
+
+/**
+ * Adds the counters of the calling thread to the total
+ */
+void stats_merge()
+{
+    pthread_mutex_lock(&stats.mutex);
+    stats.total.bytes += stats_local.bytes;
+    stats.total.lines += stats_local.lines;
+    stats.total.lines_matched += stats_local.lines_matched;
+    stats.total.walks += stats_local.walks;
+    stats.total.hops += stats_local.hops;
+    stats.total.bitmap_rejected += stats_local.bitmap_rejected;
+    stats.total.bitmap_passed += stats_local.bitmap_passed;
+    stats.total.read_seconds += stats_local.read_seconds;
+    stats.total.match_seconds += stats_local.match_seconds;
+    stats.total.write_seconds += stats_local.write_seconds;
+    pthread_mutex_unlock(&stats.mutex);
+    memset(&stats_local, 0, sizeof(struct stats_counters));
+}
+
+void stats_destroy()
+{
+    pthread_mutex_destroy(&stats.mutex);
+}
+
+uint32_t trie_linked_list_scan(uint32_t idx_first, unsigned char c)
+{
+    size_t chunk = c & TRIE_NODE_LINKED_LIST_MASK;
+    uint32_t idx = idx_first;
+    while (idx != TRIE_NULL_IDX)
+    {
+        if (trie.nodes[idx].c == c || trie.nodes[idx].idx_next[chunk] == TRIE_NULL_IDX)
+            return idx;
+        idx = trie.nodes[idx].idx_next[chunk];
+    }
+    return idx_first;
+}
+
+__attribute__((always_inline))
+static inline uint32_t trie_linked_list_find(uint32_t idx_first, unsigned char c, bool track)
+{
+    if (idx_first == TRIE_NULL_IDX)
+        return TRIE_NULL_IDX;
+    if (track)
+        stats_local.hops++;
+    struct trie_node first = trie.nodes[idx_first];
+    if (first.dense)
+        return trie.tables[first.idx_filter].idx[c];
+    if (first.idx_filter == TRIE_NULL_IDX)
+    {
+        // The linked list holds a single character
+        return first.c == c && !trie_node_is_empty(first) ? idx_first : TRIE_NULL_IDX;
+    }
+    if (!bitmap_get(trie.bitmaps[first.idx_filter].words, c & TRIE_BITMAP_MASK))
+    {
+        if (track)
+            stats_local.bitmap_rejected++;
+        return TRIE_NULL_IDX;
+    }
+    uint32_t idx = trie_linked_list_scan(idx_first, c);
+    if (track)
+        stats_local.bitmap_passed++;
+    return trie.nodes[idx].c == c ? idx : TRIE_NULL_IDX;
+}
+
+size_t trie_linked_list_collect(uint32_t idx_first, uint32_t* dst)
+{
+    size_t count = 0;
+    if (idx_first == TRIE_NULL_IDX || trie_node_is_empty(trie.nodes[idx_first]))
+        return count;
+    dst[count++] = idx_first;
+    // Only the first node has links to every chunk, the rest of the nodes belong to a single chunk
+    for (size_t chunk = 0; chunk < TRIE_NODE_LINKED_LIST_CHUNKS; chunk++)
+    {
+        for (uint32_t idx = trie.nodes[idx_first].idx_next[chunk]; idx != TRIE_NULL_IDX; idx = trie.nodes[idx].idx_next[chunk])
+            dst[count++] = idx;
+    }
+    return count;
+}
+
+void trie_node_init(struct trie_node* node, unsigned char c)
+{
+    memset(node, 0, TRIE_NODE_SIZE);
+    for (size_t i = 0; i < TRIE_NODE_LINKED_LIST_CHUNKS; i++)
+        node->idx_next[i] = TRIE_NULL_IDX;
+    node->idx_child = TRIE_NULL_IDX;
+    node->idx_filter = TRIE_NULL_IDX;
+    node->c = c;
+}
+
+int trie_keyword_compare(const void* a, const void* b)
+{
+    const struct string* x = a;
+    const struct string* y = b;
+    int result = memcmp(x->data, y->data, x->length < y->length ? x->length : y->length);
+    if (result != 0)
+        return result;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+#define TRIE_SORT_BUCKETS (257 * 257)
+
+/**
+ * Bucket of a keyword by its first two bytes, in the order of trie_keyword_compare(). A missing byte goes first.
+ */
+size_t trie_sort_bucket(struct string keyword)
+{
+    size_t b0 = keyword.length > 0 ? keyword.data[0] + 1 : 0;
+    size_t b1 = keyword.length > 1 ? keyword.data[1] + 1 : 0;
+    return b0 * 257 + b1;
+}
+
+/**
+ * The keywords are distributed into buckets by their first two bytes, then the buckets are sorted on separate threads
+ */
+struct trie_sort
+{
+    struct string* keywords;
+    size_t* bucket_offsets;
+    size_t bucket_next;
+    pthread_mutex_t mutex;
+};
+
+void* trie_sort_worker(void* arg)
+{
+    struct trie_sort* sort = arg;
+    while (true)
+    {
+        pthread_mutex_lock(&sort->mutex);
+        size_t bucket = sort->bucket_next++;
+        pthread_mutex_unlock(&sort->mutex);
+        if (bucket >= TRIE_SORT_BUCKETS)
+            break;
+        size_t offset = sort->bucket_offsets[bucket];
+        size_t count = sort->bucket_offsets[bucket + 1] - offset;
+        if (count > 1)
+            qsort(sort->keywords + offset, count, sizeof(struct string), trie_keyword_compare);
+    }
+    return NULL;
+}
+
+/**
+ * Sorts the keywords on the given number of threads. Returns the sorted array, the source one is freed.
+ */
+struct string* trie_sort_keywords(struct string* keywords, size_t count, size_t threads_count)
+{
+    struct trie_sort sort;
+    sort.bucket_offsets = malloc_or_fatal(sizeof(size_t) * (TRIE_SORT_BUCKETS + 1));
+    memset(sort.bucket_offsets, 0, sizeof(size_t) * (TRIE_SORT_BUCKETS + 1));
+    for (size_t i = 0; i < count; i++)
+        sort.bucket_offsets[trie_sort_bucket(keywords[i]) + 1]++;
+    for (size_t bucket = 0; bucket < TRIE_SORT_BUCKETS; bucket++)
+        sort.bucket_offsets[bucket + 1] += sort.bucket_offsets[bucket];
+
+    // Bucket offsets are moved forward while the keywords are distributed and then restored
+    sort.keywords = malloc_or_fatal(sizeof(struct string) * (count > 0 ? count : 1));
+    for (size_t i = 0; i < count; i++)
+        sort.keywords[sort.bucket_offsets[trie_sort_bucket(keywords[i])]++] = keywords[i];
+    for (size_t bucket = TRIE_SORT_BUCKETS; bucket > 0; bucket--)
+        sort.bucket_offsets[bucket] = sort.bucket_offsets[bucket - 1];
+    sort.bucket_offsets[0] = 0;
+    free(keywords);
+
+    sort.bucket_next = 0;
+    pthread_mutex_init(&sort.mutex, NULL);
+    pthread_t* threads = malloc_or_fatal(sizeof(pthread_t) * threads_count);
+    for (size_t i = 1; i < threads_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, trie_sort_worker, &sort) != 0)
+            fatal("Failed to create a thread");
+    }
+    trie_sort_worker(&sort);
+    for (size_t i = 1; i < threads_count; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&sort.mutex);
+    free(sort.bucket_offsets);
+    return sort.keywords;
+}
+
+/**
+ * A range of sorted keywords that share a prefix of the given length and continue with the characters
+ * of a single linked list
+ */
+struct trie_build_range
+{
+    size_t start;
+    size_t end;
+    size_t depth;
+    uint32_t idx_parent;
+};
+
+/**
+ * Number of nodes the sorted keywords take. Every keyword adds the nodes for the part that is not shared
+ * with the previous one.
+ */
+size_t trie_count_nodes(const struct string* keywords, size_t count)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t common = 0;
+        if (i > 0)
+        {
+            size_t limit = keywords[i - 1].length < keywords[i].length ? keywords[i - 1].length : keywords[i].length;
+            while (common < limit && keywords[i - 1].data[common] == keywords[i].data[common])
+                common++;
+        }
+        length += keywords[i].length - common;
+    }
+    return length;
+}
+
+/**
+ * Removes repeated keywords from the sorted array and, if prune is set, the keywords that have a shorter one
+ * as a prefix. Such a keyword can only match where its prefix does, so it never changes whether a line matches
+ * or which match is the leftmost shortest one. In sorted order every keyword that starts with a prefix follows
+ * it, so comparing with the last kept keyword is enough. Returns the number of kept keywords.
+ */
+size_t trie_prune_keywords(struct string* keywords, size_t count, bool prune)
+{
+    size_t nodes = prune ? trie_count_nodes(keywords, count) : 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (kept > 0)
+        {
+            struct string last = keywords[kept - 1];
+            bool prefix = last.length <= keywords[i].length && memcmp(last.data, keywords[i].data, last.length) == 0;
+            if (prefix && last.length == keywords[i].length)
+            {
+                trie.duplicates_count++;
+                continue;
+            }
+            if (prefix && prune)
+            {
+                trie.pruned_count++;
+                continue;
+            }
+        }
+        keywords[kept++] = keywords[i];
+    }
+    if (prune)
+        trie.pruned_nodes = nodes - trie_count_nodes(keywords, kept);
+    return kept;
+}
+
+/**
+ * Builds the trie from the keywords at once instead of adding them one by one. The keywords are sorted,
+ * so the number of nodes is known in advance and every linked list is a contiguous range of keywords.
+ * The nodes are placed depth-first: all characters of a linked list are stored next to each other,
+ * and a chain of single-character lists takes consecutive nodes, so most of the hops during the search stay
+ * within the same cache line. Linked lists of the upper levels with a high fan-out are given transition tables.
+ * Empty and repeated keywords are skipped, and with prune the ones that have a shorter keyword as a prefix.
+ * The keywords array is freed.
+ */
+void trie_build(struct string* keywords, size_t count, size_t threads_count, bool prune)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (keywords[i].length > 0)
+            keywords[kept++] = keywords[i];
+    }
+    count = kept;
+    keywords = trie_sort_keywords(keywords, count, threads_count);
+    count = trie_prune_keywords(keywords, count, prune);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (keywords[i].length > trie.max_length)
+            trie.max_length = keywords[i].length;
+    }
+
+    size_t length = trie_count_nodes(keywords, count);
+    if (length > TRIE_MAX_LENGTH)
+        fatal("Too many substrings");
+    trie.capacity = length > 0 ? length : 1;
+    trie.nodes = trie_array_alloc(TRIE_NODE_SIZE * trie.capacity);
+    // The root of an empty trie
+    trie_node_init(&trie.nodes[0], 0);
+    trie.length = count > 0 ? 0 : 1;
+
+    size_t tables_capacity = 0;
+    size_t stack_capacity = 256;
+    size_t stack_length = 0;
+    struct trie_build_range* stack = malloc_or_fatal(sizeof(struct trie_build_range) * stack_capacity);
+    struct trie_build_range groups[TRIE_BITMAP_MASK + 1];
+    if (count > 0)
+        stack[stack_length++] = (struct trie_build_range) {0, count, 0, TRIE_NULL_IDX};
+    while (stack_length > 0)
+    {
+        struct trie_build_range range = stack[--stack_length];
+        uint32_t idx_first = trie.length;
+        if (range.idx_parent != TRIE_NULL_IDX)
+            trie.nodes[range.idx_parent].idx_child = idx_first;
+
+        // Split the range by the next character, every part becomes a node of the linked list
+        size_t groups_length = 0;
+        uint32_t idx_last[TRIE_NODE_LINKED_LIST_CHUNKS];
+        for (size_t chunk = 0; chunk < TRIE_NODE_LINKED_LIST_CHUNKS; chunk++)
+            idx_last[chunk] = idx_first;
+        for (size_t i = range.start; i < range.end;)
+        {
+            unsigned char c = keywords[i].data[range.depth];
+            uint32_t idx = trie.length++;
+            struct trie_node* node = &trie.nodes[idx];
+            trie_node_init(node, c);
+            if (idx != idx_first)
+            {
+                size_t chunk = c & TRIE_NODE_LINKED_LIST_MASK;
+                trie.nodes[idx_last[chunk]].idx_next[chunk] = idx;
+                idx_last[chunk] = idx;
+            }
+
+            // Shorter keywords go first, they end at this node
+            for (; i < range.end && keywords[i].data[range.depth] == c && keywords[i].length == range.depth + 1; i++)
+                node->leaf = true;
+            size_t start = i;
+            for (; i < range.end && keywords[i].data[range.depth] == c; i++);
+            groups[groups_length++] = (struct trie_build_range) {start, i, range.depth + 1, idx};
+        }
+
+        if (groups_length >= TRIE_DENSE_MIN_FANOUT && range.depth < TRIE_DENSE_MAX_DEPTH)
+        {
+            if (trie.tables_length == tables_capacity)
+            {
+                tables_capacity = tables_capacity > 0 ? tables_capacity * 2 : 64;
+                trie.tables = realloc_or_fatal(trie.tables, sizeof(struct trie_table) * tables_capacity);
+            }
+            struct trie_table* table = &trie.tables[trie.tables_length];
+            memset(table, 0xFF, sizeof(struct trie_table));
+            for (size_t i = 0; i < groups_length; i++)
+                table->idx[trie.nodes[idx_first + i].c] = idx_first + i;
+            trie.nodes[idx_first].dense = true;
+            trie.nodes[idx_first].idx_filter = trie.tables_length++;
+        }
+        else if (groups_length > 1)
+        {
+            uint32_t idx_bitmap = trie_bitmap_add();
+            for (size_t i = 0; i < groups_length; i++)
+                bitmap_set(trie.bitmaps[idx_bitmap].words, trie.nodes[idx_first + i].c & TRIE_BITMAP_MASK);
+            trie.nodes[idx_first].idx_filter = idx_bitmap;
+        }
+
+        // The first character's subtree goes first
+        if (stack_capacity < stack_length + groups_length)
+        {
+            stack_capacity = (stack_length + groups_length) * 2;
+            stack = realloc_or_fatal(stack, sizeof(struct trie_build_range) * stack_capacity);
+        }
+        for (size_t i = groups_length; i > 0; i--)
+        {
+            if (groups[i - 1].start < groups[i - 1].end)
+                stack[stack_length++] = groups[i - 1];
+        }
+    }
+    free(stack);
+    free(keywords);
+
+    if (trie.tables_length > 0)
+        trie.tables = realloc_or_fatal(trie.tables, sizeof(struct trie_table) * trie.tables_length);
+    if (trie.bitmaps_length > 0 && trie.bitmaps_length < trie.bitmaps_capacity)
+    {
+        trie.bitmaps_capacity = trie.bitmaps_length;
+        trie.bitmaps = realloc_or_fatal(trie.bitmaps, sizeof(struct trie_bitmap) * trie.bitmaps_capacity);
+    }
+}
+
+/**
+ * Maps an input byte to the alphabet of the trie. The matching functions take fold as a constant, so each of them
+ * is specialized for both modes and the case-sensitive walk does not pay for the lookup.
+ */
+#define trie_fold(c, fold) ((fold) ? string_lower_lookup[c] : (c))
+
+/**
+ * Calls the specialization of a matching function for the case folding and the stats of the current run
+ */
+#define trie_specialize(function, ...) \
+    (trie.case_insensitive \
+        ? (stats.enabled ? function(__VA_ARGS__, true, true) : function(__VA_ARGS__, true, false)) \
+        : (stats.enabled ? function(__VA_ARGS__, false, true) : function(__VA_ARGS__, false, false)))
+
+__attribute__((always_inline))
+static inline size_t trie_match_str(struct string str, bool longest, bool fold, bool track)
+{
+    uint32_t idx = 0;
+    size_t i = 0;
+    size_t length = 0;
+    if (track)
+        stats_local.walks++;
+    while (true)
+    {
+        unsigned char c = trie_fold(str.data[i], fold);
+
+        // Scan linked list inside the node
+        idx = trie_linked_list_find(idx, c, track);
+        if (idx == TRIE_NULL_IDX)
+            return length;
+        struct trie_node node = trie.nodes[idx];
+        if (node.leaf)
+        {
+            // A leaf may still have children, the longer keywords that start with this one
+            length = i + 1;
+            if (!longest)
+                return length;
+        }
+        if (str.length - i <= 1)
+            return length;
 
         // Then go to the child node
         idx = node.idx_child;
 
-        i++;
+        i++;
+    }
+    return length;
+}
+
+#define trie_state_children(idx_state) ((idx_state) == TRIE_NULL_IDX ? 0 : trie.nodes[idx_state].idx_child)
+
+__attribute__((always_inline))
+static inline uint32_t trie_state_next(uint32_t idx_state, unsigned char c, bool track)
+{
+    while (true)
+    {
+        uint32_t idx_next = trie_linked_list_find(trie_state_children(idx_state), c, track);
+        if (idx_next != TRIE_NULL_IDX || idx_state == TRIE_NULL_IDX)
+            return idx_next;
+        idx_state = trie.idx_fail[idx_state];
+    }
+}
+
+void trie_build_automaton()
+{
+    if (trie.engine != TRIE_ENGINE_AHO_CORASICK || trie.automaton_loaded)
+        return;
+
+    trie.idx_fail = trie_array_alloc(sizeof(uint32_t) * trie.length);
+    trie.idx_output = trie_array_alloc(sizeof(uint32_t) * trie.length);
+    trie.depth = trie_array_alloc(sizeof(uint32_t) * trie.length);
+
+    // Breadth-first traversal guarantees that failure links of shallower nodes are ready
+    uint32_t* queue = malloc_or_fatal(sizeof(uint32_t) * trie.length);
+    size_t queue_length = trie_linked_list_collect(0, queue);
+    for (size_t i = 0; i < queue_length; i++)
+    {
+        uint32_t idx = queue[i];
+        trie.idx_fail[idx] = TRIE_NULL_IDX;
+        trie.idx_output[idx] = TRIE_NULL_IDX;
+        trie.depth[idx] = 1;
+    }
+    for (size_t queue_offset = 0; queue_offset < queue_length; queue_offset++)
+    {
+        uint32_t idx_parent = queue[queue_offset];
+        size_t children_count = trie_linked_list_collect(trie.nodes[idx_parent].idx_child, queue + queue_length);
+        for (size_t i = queue_length; i < queue_length + children_count; i++)
+        {
+            uint32_t idx = queue[i];
+            uint32_t idx_fail = trie_state_next(trie.idx_fail[idx_parent], trie.nodes[idx].c, false);
+            trie.idx_fail[idx] = idx_fail;
+            trie.idx_output[idx] = idx_fail == TRIE_NULL_IDX || trie.nodes[idx_fail].leaf
+                ? idx_fail
+                : trie.idx_output[idx_fail];
+            trie.depth[idx] = trie.depth[idx_parent] + 1;
+        }
+        queue_length += children_count;
+    }
+    free(queue);
+}
+
+/**
+ * Returns the length of the shortest keyword, if it is below the given limit, otherwise the limit
+ */
+size_t trie_min_keyword_length(uint32_t idx_list, size_t depth, size_t limit)
+{
+    uint32_t list[TRIE_BITMAP_MASK + 1];
+    size_t list_length = trie_linked_list_collect(idx_list, list);
+    for (size_t i = 0; i < list_length && depth < limit; i++)
+    {
+        if (trie.nodes[list[i]].leaf)
+            return depth + 1;
+        limit = trie_min_keyword_length(trie.nodes[list[i]].idx_child, depth + 1, limit);
+    }
+    return limit;
+}
+
+/**
+ * Collects the bytes that occur at each position of the keyword prefixes, separately for every bucket
+ */
+void trie_prefilter_add(uint32_t idx_list, struct trie_bitmap (*bytes)[PREFILTER_MAX_LENGTH], size_t bucket, size_t depth)
+{
+    uint32_t list[TRIE_BITMAP_MASK + 1];
+    size_t list_length = trie_linked_list_collect(idx_list, list);
+    for (size_t i = 0; i < list_length; i++)
+    {
+        struct trie_node node = trie.nodes[list[i]];
+        // Prefixes with the same first byte share a bucket
+        size_t node_bucket = depth == 0 ? node.c % PREFILTER_BUCKETS : bucket;
+        bitmap_set(bytes[node_bucket][depth].words, node.c);
+        if (depth + 1 < trie.prefilter.length && depth + 1 < PREFILTER_MAX_LENGTH)
+            trie_prefilter_add(node.idx_child, bytes, node_bucket, depth + 1);
+    }
+}
+
+/**
+ * Fills the prefilter with the prefixes of all keywords and disables it if too many positions of a random text
+ * would pass it, as then skipping would not pay off
+ */
+void trie_build_prefilter(bool enabled)
+{
+    struct prefilter* prefilter = &trie.prefilter;
+    memset(prefilter, 0, sizeof(struct prefilter));
+    if (!enabled)
+        return;
+    prefilter->length = trie_min_keyword_length(0, 0, PREFILTER_MAX_LENGTH);
+    struct trie_bitmap bytes[PREFILTER_BUCKETS][PREFILTER_MAX_LENGTH];
+    memset(bytes, 0, sizeof(bytes));
+    trie_prefilter_add(0, bytes, 0, 0);
+
+    // The input is not folded before the prefilter, so every byte that folds into a keyword byte must pass it
+    for (size_t b = 0; b < PREFILTER_BUCKETS; b++)
+    {
+        for (size_t k = 0; k < prefilter->length; k++)
+        {
+            for (int c = 0; c <= 255; c++)
+            {
+                if (!bitmap_get(bytes[b][k].words, trie_fold(c, trie.case_insensitive)))
+                    continue;
+                prefilter->lo[k][c & 0x0F] |= 1 << b;
+                prefilter->hi[k][c >> 4] |= 1 << b;
+            }
+        }
+    }
+
+    double pass_rate = 1.0;
+    for (size_t b = 0; b < PREFILTER_BUCKETS; b++)
+    {
+        double bucket_rate = 1.0;
+        for (size_t k = 0; k < prefilter->length; k++)
+        {
+            size_t lo_count = 0;
+            size_t hi_count = 0;
+            for (size_t nibble = 0; nibble < 16; nibble++)
+            {
+                lo_count += (prefilter->lo[k][nibble] >> b) & 1;
+                hi_count += (prefilter->hi[k][nibble] >> b) & 1;
+            }
+            bucket_rate *= (lo_count / 16.0) * (hi_count / 16.0);
+        }
+        pass_rate *= 1.0 - bucket_rate;
+    }
+    prefilter->candidate_rate = 1.0 - pass_rate;
+    if (prefilter->candidate_rate > PREFILTER_MAX_CANDIDATE_RATE)
+        prefilter->length = 0;
+}
+
+bool trie_build_from_file(unsigned char* substrings_filename, size_t threads_count, bool prune)
+{
+    int file = open(substrings_filename, O_RDONLY | O_BINARY);
+    if (file < 0)
+        return index_fail("No access to file %s", substrings_filename);
+    struct stat stat;
+    if (fstat(file, &stat) < 0)
+    {
+        close(file);
+        return index_fail("No access to file %s", substrings_filename);
+    }
+
+    // The whole file is kept in memory while the trie is built, the keywords are slices of it
+    struct fstream stream = fstream_init_mapped(file, stat.st_size);
+    while (fstream_read_to_buffer(&stream));
+    close(file);
+    struct string data = {stream.buffer, stream.buffer_size};
+    struct string lower = string_init();
+    if (trie.case_insensitive)
+    {
+        string_to_lower(data, &lower);
+        data = string_sub(lower, 0, data.length);
+    }
+
+    size_t keywords_capacity = 1024;
+    size_t keywords_count = 0;
+    struct string* keywords = malloc_or_fatal(sizeof(struct string) * keywords_capacity);
+    for (size_t offset = 0; offset < data.length;)
+    {
+        void* delimptr = _memchr(data.data + offset, trie.delimiter, data.length - offset);
+        size_t length = delimptr != NULL
+            ? delimptr - (void*)data.data - offset
+            : data.length - offset;
+        struct string keyword = string_sub(data, offset, length);
+        if (trie.delimiter == '\n')
+            string_trim_end(&keyword, '\r');
+        offset += length + 1;
+        if (keywords_count == keywords_capacity)
+        {
+            keywords_capacity *= 2;
+            keywords = realloc_or_fatal(keywords, sizeof(struct string) * keywords_capacity);
+        }
+        keywords[keywords_count++] = keyword;
+    }
+
+    trie_build(keywords, keywords_count, threads_count, prune);
+    string_destroy(&lower);
+    fstream_destroy(&stream);
+    return true;
+}
+
+void trie_build_from_args(struct string* substrings, size_t substrings_count, size_t threads_count, bool prune)
+{
+    struct string* keywords = malloc_or_fatal(sizeof(struct string) * (substrings_count > 0 ? substrings_count : 1));
+    for (size_t i = 0; i < substrings_count; i++)
+    {
+        keywords[i] = substrings[i];
+        if (trie.case_insensitive)
+            string_to_lower(keywords[i], &keywords[i]);
+    }
+    trie_build(keywords, substrings_count, threads_count, prune);
+}
+
+struct trie_match {
+    size_t offset;
+    size_t length;
+};
+
+__attribute__((always_inline))
+static inline struct trie_match trie_find_match_trie(struct string str, bool longest, bool fold, bool track)
+{
+    struct trie_match match;
+    match.offset = 0;
+    match.length = 0;
+    for (; match.offset < str.length; match.offset++)
+    {
+        match.offset = prefilter_find(&trie.prefilter, str, match.offset);
+        if (match.offset >= str.length)
+            break;
+        match.length = trie_match_str(string_sub(str, match.offset, str.length - match.offset), longest, fold, track);
+        if (match.length > 0)
+            return match;
+    }
+    return match;
+}
+
+#define TRIE_BATCH_SIZE 8
+
+/**
+ * Smaller tries stay in the cache, and there interleaving the walks costs more than it saves
+ */
+#define TRIE_BATCH_MIN_NODES (384 * 1024)
+
+/**
+ * A walk of the trie that starts at one offset of the line
+ */
+struct trie_cursor
+{
+    size_t offset;
+    size_t length;
+
+    /**
+     * The linked list to look up the next character in
+     */
+    uint32_t idx;
+};
+
+/**
+ * Same as trie_find_match_trie(), but the walks from several offsets are advanced together. Every walk is
+ * a chain of dependent loads, and when the trie does not fit into the cache the next node of each walk is prefetched,
+ * so their cache misses overlap instead of following one another.
+ */
+__attribute__((always_inline))
+static inline struct trie_match trie_find_match_trie_batched(struct string str, bool longest, bool fold, bool track)
+{
+    struct trie_match match;
+    match.offset = str.length;
+    match.length = 0;
+    struct trie_cursor cursors[TRIE_BATCH_SIZE];
+    size_t cursors_count = 0;
+    size_t offset = prefilter_find(&trie.prefilter, str, 0);
+    while (true)
+    {
+        // Only the walks that start to the left of the best match found so far may improve it
+        for (; cursors_count < TRIE_BATCH_SIZE && offset < match.offset; offset = prefilter_find(&trie.prefilter, str, offset + 1))
+        {
+            cursors[cursors_count++] = (struct trie_cursor) {offset, 0, 0};
+            if (track)
+                stats_local.walks++;
+        }
+        if (cursors_count == 0)
+            break;
+
+        for (size_t k = 0; k < cursors_count;)
+        {
+            struct trie_cursor* cursor = &cursors[k];
+            unsigned char c = trie_fold(str.data[cursor->offset + cursor->length], fold);
+            uint32_t idx = trie_linked_list_find(cursor->idx, c, track);
+            bool finished = true;
+            if (idx != TRIE_NULL_IDX)
+            {
+                struct trie_node node = trie.nodes[idx];
+                cursor->length++;
+                if (node.leaf && (cursor->offset < match.offset || (longest && cursor->offset == match.offset)))
+                {
+                    match.offset = cursor->offset;
+                    match.length = cursor->length;
+                }
+                bool improves = cursor->offset < match.offset || (longest && cursor->offset == match.offset);
+                if ((!node.leaf || longest) && improves && cursor->offset + cursor->length < str.length)
+                {
+                    cursor->idx = node.idx_child;
+                    __builtin_prefetch(&trie.nodes[node.idx_child]);
+                    finished = false;
+                }
+            }
+            // The order of the walks does not matter, the leftmost match is kept anyway
+            if (finished)
+                cursors[k] = cursors[--cursors_count];
+            else
+                k++;
+        }
+    }
+    return match;
+}
+
+/**
+ * A single-pass scan of one line by the Aho-Corasick automaton
+ */
+struct trie_scan
+{
+    struct string str;
+    size_t offset;
+    uint32_t idx_state;
+    struct trie_match match;
+};
+
+struct trie_scan trie_scan_init(struct string str)
+{
+    struct trie_scan scan;
+    scan.str = str;
+    scan.offset = 0;
+    scan.idx_state = TRIE_NULL_IDX;
+    scan.match.offset = 0;
+    scan.match.length = 0;
+    return scan;
+}
+
+/**
+ * Feeds the next byte of the line to the automaton. Returns false once the match is final.
+ */
+__attribute__((always_inline))
+static inline bool trie_scan_step(struct trie_scan* scan, bool leftmost, bool longest, bool fold, bool track)
+{
+    struct string str = scan->str;
+    if (scan->idx_state == TRIE_NULL_IDX)
+    {
+        // Nothing is pending, so skip the bytes that cannot start a keyword
+        scan->offset = prefilter_find(&trie.prefilter, str, scan->offset);
+        if (scan->offset >= str.length)
+            return false;
+        if (track)
+            stats_local.walks++;
+    }
+    size_t i = scan->offset++;
+    uint32_t idx_state = trie_state_next(scan->idx_state, trie_fold(str.data[i], fold), track);
+    scan->idx_state = idx_state;
+    if (idx_state == TRIE_NULL_IDX)
+        return scan->match.length == 0 && scan->offset < str.length;
+
+    // No keyword that starts before the found one, or at the same offset if the longest one is wanted,
+    // can end at this or any further offset
+    if (scan->match.length > 0 && i + 1 - trie.depth[idx_state] + !longest > scan->match.offset)
+        return false;
+
+    // The longest keyword that ends at this offset starts at the leftmost position
+    struct trie_node node = trie.nodes[idx_state];
+    uint32_t idx_leaf = node.leaf ? idx_state : trie.idx_output[idx_state];
+    if (idx_leaf != TRIE_NULL_IDX)
+    {
+        size_t offset = i + 1 - trie.depth[idx_leaf];
+        if (scan->match.length == 0 || offset < scan->match.offset || (longest && offset == scan->match.offset))
+        {
+            scan->match.offset = offset;
+            scan->match.length = trie.depth[idx_leaf];
+            if (!leftmost)
+                return false;
+        }
+    }
+    __builtin_prefetch(&trie.nodes[node.idx_child]);
+    return scan->offset < str.length;
+}
+
+__attribute__((always_inline))
+static inline struct trie_match trie_find_match_aho_corasick(struct string str, bool leftmost, bool longest, bool fold, bool track)
+{
+    struct trie_scan scan = trie_scan_init(str);
+    while (trie_scan_step(&scan, leftmost, longest, fold, track));
+    return scan.match;
+}
+
+/**
+ * Scans several lines together, one byte of each line at a time, so the cache misses of the independent scans
+ * overlap. See trie_find_match_trie_batched().
+ */
+__attribute__((always_inline))
+static inline void trie_find_matches_aho_corasick(const struct string* lines, size_t count, bool leftmost, bool longest, struct trie_match* matches, bool fold, bool track)
+{
+    struct trie_scan scans[TRIE_BATCH_SIZE];
+    size_t lines_idx[TRIE_BATCH_SIZE];
+    size_t scans_count = 0;
+    size_t line = 0;
+    while (true)
+    {
+        for (; scans_count < TRIE_BATCH_SIZE && line < count; line++)
+        {
+            struct string str = lines[line];
+            trie_trim_line(&str);
+            struct trie_scan scan = trie_scan_init(str);
+            if (str.length == 0)
+            {
+                matches[line] = scan.match;
+                continue;
+            }
+            lines_idx[scans_count] = line;
+            scans[scans_count++] = scan;
+        }
+        if (scans_count == 0)
+            break;
+
+        for (size_t k = 0; k < scans_count;)
+        {
+            if (trie_scan_step(&scans[k], leftmost, longest, fold, track))
+            {
+                k++;
+                continue;
+            }
+            matches[lines_idx[k]] = scans[k].match;
+            scans_count--;
+            scans[k] = scans[scans_count];
+            lines_idx[k] = lines_idx[scans_count];
+        }
+    }
+}
+
+/**
+ * Finds the keyword that starts at the leftmost offset of the line. If several keywords start there, the shortest one is taken,
+ * or the longest one if longest is set. If leftmost is not set, any match may be returned.
+ */
+struct trie_match trie_find_match(struct string str, bool leftmost, bool longest)
+{
+    trie_trim_line(&str);
+    if (trie.engine == TRIE_ENGINE_MEMMEM)
+    {
+        size_t offset = simd.memmem(str.data, str.length, trie.keyword.data, trie.keyword.length);
+        return (struct trie_match) {offset, offset < str.length ? trie.keyword.length : 0};
+    }
+    if (trie.engine == TRIE_ENGINE_AHO_CORASICK)
+        return trie_specialize(trie_find_match_aho_corasick, str, leftmost, longest);
+    if (trie.length >= TRIE_BATCH_MIN_NODES)
+        return trie_specialize(trie_find_match_trie_batched, str, longest);
+    return trie_specialize(trie_find_match_trie, str, longest);
+}
+
+/**
+ * Same as trie_find_match() for several lines. On large tries the Aho-Corasick engine scans the lines together.
+ */
+void trie_find_matches(const struct string* lines, size_t count, bool leftmost, bool longest, struct trie_match* matches)
+{
+    if (trie.engine != TRIE_ENGINE_AHO_CORASICK || trie.length < TRIE_BATCH_MIN_NODES)
+    {
+        for (size_t i = 0; i < count; i++)
+            matches[i] = trie_find_match(lines[i], leftmost, longest);
+        return;
+    }
+    trie_specialize(trie_find_matches_aho_corasick, lines, count, leftmost, longest, matches);
+}
+
+/**
+ * Growable list of the matches found in a line
+ */
+struct trie_matches
+{
+    struct trie_match* data;
+    size_t length;
+    size_t capacity;
+};
+
+struct trie_matches trie_matches_init()
+{
+    struct trie_matches matches;
+    matches.data = NULL;
+    matches.length = 0;
+    matches.capacity = 0;
+    return matches;
+}
+
+void trie_matches_add(struct trie_matches* matches, size_t offset, size_t length)
+{
+    if (matches->length == matches->capacity)
+    {
+        matches->capacity = matches->capacity > 0 ? matches->capacity * 2 : 64;
+        matches->data = realloc_or_fatal(matches->data, sizeof(struct trie_match) * matches->capacity);
+    }
+    matches->data[matches->length++] = (struct trie_match) {offset, length};
+}
+
+void trie_matches_destroy(struct trie_matches* matches)
+{
+    free(matches->data);
+    matches->data = NULL;
+    matches->length = 0;
+    matches->capacity = 0;
+}
+
+int trie_match_compare(const void* a, const void* b)
+{
+    const struct trie_match* x = a;
+    const struct trie_match* y = b;
+    if (x->offset != y->offset)
+        return (x->offset > y->offset) - (x->offset < y->offset);
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+/**
+ * Walks the trie from every offset and adds each keyword that starts there, or only the longest one
+ */
+__attribute__((always_inline))
+static inline void trie_find_all_matches_trie(struct string str, bool longest, struct trie_matches* matches, bool fold, bool track)
+{
+    for (size_t offset = prefilter_find(&trie.prefilter, str, 0); offset < str.length; offset = prefilter_find(&trie.prefilter, str, offset + 1))
+    {
+        if (track)
+            stats_local.walks++;
+        size_t length = 0;
+        size_t longest_length = 0;
+        for (uint32_t idx = 0; offset + length < str.length;)
+        {
+            idx = trie_linked_list_find(idx, trie_fold(str.data[offset + length], fold), track);
+            if (idx == TRIE_NULL_IDX)
+                break;
+            length++;
+            struct trie_node node = trie.nodes[idx];
+            if (node.leaf && !longest)
+                trie_matches_add(matches, offset, length);
+            else if (node.leaf)
+                longest_length = length;
+            idx = node.idx_child;
+        }
+        if (longest_length > 0)
+            trie_matches_add(matches, offset, longest_length);
+    }
+}
+
+/**
+ * Scans the line once and adds every keyword that ends at each offset. They are found by following the output links
+ * from the current state, so the number of steps is linear in the length of the line plus the number of matches.
+ */
+__attribute__((always_inline))
+static inline void trie_find_all_matches_aho_corasick(struct string str, struct trie_matches* matches, bool fold, bool track)
+{
+    uint32_t idx_state = TRIE_NULL_IDX;
+    for (size_t i = 0; i < str.length; i++)
+    {
+        if (idx_state == TRIE_NULL_IDX)
+        {
+            i = prefilter_find(&trie.prefilter, str, i);
+            if (i >= str.length)
+                break;
+            if (track)
+                stats_local.walks++;
+        }
+        idx_state = trie_state_next(idx_state, trie_fold(str.data[i], fold), track);
+        if (idx_state == TRIE_NULL_IDX)
+            continue;
+        uint32_t idx_leaf = trie.nodes[idx_state].leaf ? idx_state : trie.idx_output[idx_state];
+        for (; idx_leaf != TRIE_NULL_IDX; idx_leaf = trie.idx_output[idx_leaf])
+            trie_matches_add(matches, i + 1 - trie.depth[idx_leaf], trie.depth[idx_leaf]);
+    }
+}
+
+/**
+ * Replaces the matches with every occurrence of every keyword in the line, ordered by the offset and then by the length.
+ * If longest is set, only the longest keyword is kept at each offset.
+ */
+void trie_find_all_matches(struct string str, bool longest, struct trie_matches* matches)
+{
+    trie_trim_line(&str);
+    matches->length = 0;
+    if (trie.engine == TRIE_ENGINE_MEMMEM)
+    {
+        size_t offset = 0;
+        while ((offset += simd.memmem(str.data + offset, str.length - offset, trie.keyword.data, trie.keyword.length)) < str.length)
+            trie_matches_add(matches, offset++, trie.keyword.length);
+        return;
+    }
+    if (trie.engine != TRIE_ENGINE_AHO_CORASICK)
+    {
+        trie_specialize(trie_find_all_matches_trie, str, longest, matches);
+        return;
+    }
+
+    // The automaton finds the matches in the order of their ends
+    trie_specialize(trie_find_all_matches_aho_corasick, str, matches);
+    if (matches->length > 1)
+        qsort(matches->data, matches->length, sizeof(struct trie_match), trie_match_compare);
+    if (longest)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < matches->length; i++)
+        {
+            if (kept > 0 && matches->data[kept - 1].offset == matches->data[i].offset)
+                kept--;
+            matches->data[kept++] = matches->data[i];
+        }
+        matches->length = kept;
+    }
+}
+
+#define TRIE_INDEX_MAGIC "FINDANYI"
+#define TRIE_INDEX_VERSION 4
+#define TRIE_INDEX_ALIGNMENT 64
+
+#define TRIE_INDEX_FLAG_CASE_INSENSITIVE 1
+#define TRIE_INDEX_FLAG_AHO_CORASICK 2
+
+/**
+ * The index file starts with this header, followed by the node, bitmap and transition table arrays and,
+ * if the Aho-Corasick flag is set, by the failure link, output link and depth arrays. Every section is aligned, so the file can be mapped
+ * into memory and used as is.
+ */
+struct trie_index_header
+{
+    char magic[8];
+    uint32_t version;
+
+    /**
+     * Sizes of the node and the index type. An index built on a platform with a different layout is rejected.
+     */
+    uint16_t node_size;
+    uint16_t idx_size;
+
+    uint64_t length;
+    uint64_t bitmaps_length;
+    uint64_t tables_length;
+    uint64_t max_length;
+    uint32_t flags;
+} __attribute__((aligned(TRIE_INDEX_ALIGNMENT)));
+
+#define trie_index_section_size(size) (((size) + TRIE_INDEX_ALIGNMENT - 1) & ~(size_t)(TRIE_INDEX_ALIGNMENT - 1))
+
+void trie_index_write_section(int file, const void* data, size_t size)
+{
+    static const unsigned char padding[TRIE_INDEX_ALIGNMENT] = {0};
+    write_or_fatal(file, data, size);
+    write_or_fatal(file, padding, trie_index_section_size(size) - size);
+}
+
+void trie_save(unsigned char* index_filename)
+{
+    int file = open(index_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
+    if (file < 0)
+        fatal("No access to file %s", index_filename);
+
+    struct trie_index_header header;
+    memset(&header, 0, sizeof(struct trie_index_header));
+    memcpy(header.magic, TRIE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = TRIE_INDEX_VERSION;
+    header.node_size = TRIE_NODE_SIZE;
+    header.idx_size = sizeof(uint32_t);
+    header.length = trie.length;
+    header.bitmaps_length = trie.bitmaps_length;
+    header.tables_length = trie.tables_length;
+    header.max_length = trie.max_length;
+    if (trie.case_insensitive)
+        header.flags |= TRIE_INDEX_FLAG_CASE_INSENSITIVE;
+    if (trie.idx_fail != NULL)
+        header.flags |= TRIE_INDEX_FLAG_AHO_CORASICK;
+
+    trie_index_write_section(file, &header, sizeof(struct trie_index_header));
+    trie_index_write_section(file, trie.nodes, TRIE_NODE_SIZE * trie.length);
+    trie_index_write_section(file, trie.bitmaps, sizeof(struct trie_bitmap) * trie.bitmaps_length);
+    trie_index_write_section(file, trie.tables, sizeof(struct trie_table) * trie.tables_length);
+    if (trie.idx_fail != NULL)
+    {
+        trie_index_write_section(file, trie.idx_fail, sizeof(uint32_t) * trie.length);
+        trie_index_write_section(file, trie.idx_output, sizeof(uint32_t) * trie.length);
+        trie_index_write_section(file, trie.depth, sizeof(uint32_t) * trie.length);
+    }
+    close(file);
+}
+
+/**
+ * Over this many nodes the trie no longer fits the cache. The failure links of Aho-Corasick add 12 bytes per node
+ * to every step and take longer to build than the trie itself, while a walk of the trie engine is batched.
+ */
+#define TRIE_AUTO_MAX_AHO_CORASICK_NODES (1024 * 1024)
+
+/**
+ * Checks the arrays loaded from an index file before any search follows them. Every stored index must point
+ * into its array, and the links of the linked lists and to the children must point forward, as trie_build()
+ * makes them, so no walk can leave the arrays or loop. The automaton is also checked to be built on a tree:
+ * its links must lead to shallower nodes and the depths must be those of the nodes, otherwise the offsets
+ * of the matches could point outside of the line.
+ */
+bool trie_index_valid()
+{
+    for (size_t idx = 0; idx < trie.length; idx++)
+    {
+        struct trie_node node = trie.nodes[idx];
+        for (size_t chunk = 0; chunk < TRIE_NODE_LINKED_LIST_CHUNKS; chunk++)
+        {
+            if (node.idx_next[chunk] != TRIE_NULL_IDX && (node.idx_next[chunk] <= idx || node.idx_next[chunk] >= trie.length))
+                return false;
+        }
+        if (node.idx_child != TRIE_NULL_IDX && (node.idx_child <= idx || node.idx_child >= trie.length))
+            return false;
+        if (node.dense ? node.idx_filter >= trie.tables_length : node.idx_filter != TRIE_NULL_IDX && node.idx_filter >= trie.bitmaps_length)
+            return false;
+    }
+    for (size_t i = 0; i < trie.tables_length; i++)
+    {
+        for (size_t c = 0; c <= TRIE_BITMAP_MASK; c++)
+        {
+            if (trie.tables[i].idx[c] != TRIE_NULL_IDX && trie.tables[i].idx[c] >= trie.length)
+                return false;
+        }
+    }
+    if (trie.depth == NULL)
+        return true;
+
+    // Breadth-first traversal from the root list. The owner of a node is the first node of its linked list.
+    bool valid = true;
+    uint32_t* owner = malloc_or_fatal(sizeof(uint32_t) * trie.length);
+    uint32_t* queue = malloc_or_fatal(sizeof(uint32_t) * trie.length);
+    memset(owner, 0xFF, sizeof(uint32_t) * trie.length);
+    size_t queue_length = 0;
+    for (size_t queue_offset = 0; valid && queue_offset <= queue_length; queue_offset++)
+    {
+        uint32_t idx_parent = queue_offset == 0 ? TRIE_NULL_IDX : queue[queue_offset - 1];
+        uint32_t idx_first = queue_offset == 0 ? 0 : trie.nodes[idx_parent].idx_child;
+        if (idx_first == TRIE_NULL_IDX)
+            continue;
+        struct trie_node first = trie.nodes[idx_first];
+        if (trie_node_is_empty(first))
+        {
+            // Only the root of an index without keywords is empty
+            valid = idx_parent == TRIE_NULL_IDX && !first.dense && first.idx_filter == TRIE_NULL_IDX
+                && first.idx_next[0] == TRIE_NULL_IDX && first.idx_next[TRIE_NODE_LINKED_LIST_MASK] == TRIE_NULL_IDX;
+            continue;
+        }
+        size_t list_start = queue_length;
+        valid = owner[idx_first] == TRIE_NULL_IDX;
+        owner[idx_first] = idx_first;
+        queue[queue_length++] = idx_first;
+        for (size_t chunk = 0; valid && chunk < TRIE_NODE_LINKED_LIST_CHUNKS; chunk++)
+        {
+            for (uint32_t idx = first.idx_next[chunk]; valid && idx != TRIE_NULL_IDX; idx = trie.nodes[idx].idx_next[chunk])
+            {
+                valid = owner[idx] == TRIE_NULL_IDX && !trie_node_is_empty(trie.nodes[idx]) && !trie.nodes[idx].dense;
+                owner[idx] = idx_first;
+                queue[queue_length++] = idx;
+            }
+        }
+        for (size_t c = 0; valid && first.dense && c <= TRIE_BITMAP_MASK; c++)
+        {
+            uint32_t idx = trie.tables[first.idx_filter].idx[c];
+            valid = idx == TRIE_NULL_IDX || owner[idx] == idx_first;
+        }
+        for (size_t i = list_start; valid && i < queue_length; i++)
+            valid = trie.depth[queue[i]] == (idx_parent == TRIE_NULL_IDX ? 1 : trie.depth[idx_parent] + 1);
+    }
+    for (size_t i = 0; valid && i < queue_length; i++)
+    {
+        uint32_t idx = queue[i];
+        uint32_t links[] = {trie.idx_fail[idx], trie.idx_output[idx]};
+        for (size_t k = 0; valid && k < sizeof(links) / sizeof(links[0]); k++)
+        {
+            valid = links[k] == TRIE_NULL_IDX
+                || (links[k] < trie.length && owner[links[k]] != TRIE_NULL_IDX && trie.depth[links[k]] < trie.depth[idx]);
+        }
+    }
+    free(owner);
+    free(queue);
+    return valid;
+}
+
+/**
+ * Loads the trie from an index file. The file is mapped into memory when possible, so the loading takes no time
+ * and the pages are shared by all processes that use the same index. Returns whether the index is case-insensitive.
+ */
+/**
+ * Maps the index file, or reads it into memory if not mapped. Returns false with index_error if the file is not
+ * a valid index, what was loaded is then released by trie_destroy().
+ */
+bool trie_load(unsigned char* index_filename, enum trie_engine engine, bool huge_pages, unsigned char delimiter, bool mapped)
+{
+    trie_init(engine, false, huge_pages, delimiter);
+    int file = open(index_filename, O_RDONLY | O_BINARY);
+    if (file < 0)
+        return index_fail("No access to file %s", index_filename);
+    struct stat stat;
+    if (fstat(file, &stat) < 0)
+    {
+        close(file);
+        return index_fail("No access to file %s", index_filename);
+    }
+
+    // If the file cannot be mapped, read all of it
+    trie.index_stream = mapped ? fstream_init_mapped(file, stat.st_size) : fstream_init(file);
+    trie.loaded = true;
+    while (fstream_read_to_buffer(&trie.index_stream));
+    close(file);
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    // Only some file systems can back a file mapping with huge pages, others ignore it
+    if (huge_pages && trie.index_stream.mapped)
+        madvise(trie.index_stream.buffer, trie.index_stream.buffer_size, MADV_HUGEPAGE);
+#endif /* !defined(_WIN32) && defined(MADV_HUGEPAGE) */
+
+    void* data = trie.index_stream.buffer;
+    size_t size = trie.index_stream.buffer_size;
+    struct trie_index_header header;
+    if (size < sizeof(struct trie_index_header))
+        return index_fail("Invalid index file %s", index_filename);
+    memcpy(&header, data, sizeof(struct trie_index_header));
+    if (memcmp(header.magic, TRIE_INDEX_MAGIC, sizeof(header.magic)) != 0)
+        return index_fail("Invalid index file %s", index_filename);
+    if (header.version != TRIE_INDEX_VERSION || header.node_size != TRIE_NODE_SIZE || header.idx_size != sizeof(uint32_t))
+        return index_fail("Index file %s was built by an incompatible version of %s", index_filename, PROGRAM_NAME);
+
+    // The counts are bounded by the file size first, so the sizes of the sections cannot overflow
+    if (header.length == 0 || header.length > TRIE_MAX_LENGTH || header.length > size / TRIE_NODE_SIZE
+        || header.bitmaps_length > size / sizeof(struct trie_bitmap) || header.tables_length > size / sizeof(struct trie_table)
+        || header.max_length > header.length)
+        return index_fail("Invalid index file %s", index_filename);
+    bool aho_corasick = header.flags & TRIE_INDEX_FLAG_AHO_CORASICK;
+    size_t nodes_size = trie_index_section_size(TRIE_NODE_SIZE * header.length);
+    size_t bitmaps_size = trie_index_section_size(sizeof(struct trie_bitmap) * header.bitmaps_length);
+    size_t tables_size = trie_index_section_size(sizeof(struct trie_table) * header.tables_length);
+    size_t links_size = trie_index_section_size(sizeof(uint32_t) * header.length);
+    size_t expected_size = trie_index_section_size(sizeof(struct trie_index_header)) + nodes_size + bitmaps_size + tables_size + (aho_corasick ? links_size * 3 : 0);
+    if (size < expected_size)
+        return index_fail("Invalid index file %s", index_filename);
+
+    void* section = data + trie_index_section_size(sizeof(struct trie_index_header));
+    trie.nodes = section;
+    trie.capacity = trie.length = header.length;
+    section += nodes_size;
+    trie.bitmaps = section;
+    trie.bitmaps_capacity = trie.bitmaps_length = header.bitmaps_length;
+    section += bitmaps_size;
+    trie.tables = section;
+    trie.tables_length = header.tables_length;
+    trie.max_length = header.max_length;
+    section += tables_size;
+    trie.case_insensitive = header.flags & TRIE_INDEX_FLAG_CASE_INSENSITIVE;
+    if (aho_corasick && (engine == TRIE_ENGINE_AHO_CORASICK || (engine == TRIE_ENGINE_AUTO && trie.length <= TRIE_AUTO_MAX_AHO_CORASICK_NODES)))
+    {
+        trie.idx_fail = section;
+        trie.idx_output = section + links_size;
+        trie.depth = section + links_size * 2;
+        trie.automaton_loaded = true;
+    }
+    if (!trie_index_valid())
+        return index_fail("Invalid index file %s", index_filename);
+    return true;
+}
+
+size_t trie_keywords_count()
+{
+    size_t count = 0;
+    for (size_t idx = 0; idx < trie.length; idx++)
+        count += trie.nodes[idx].leaf;
+    return count;
+}
+
+/**
+ * Size of all the arrays of the index
+ */
+size_t trie_memory_size()
+{
+    size_t size = TRIE_NODE_SIZE * trie.length + sizeof(struct trie_bitmap) * trie.bitmaps_length + sizeof(struct trie_table) * trie.tables_length;
+    if (trie.idx_fail != NULL)
+        size += sizeof(uint32_t) * 3 * trie.length;
+    return size;
+}
+
+/**
+ * Replaces the auto engine with the one that fits the keywords: memmem for a single keyword, trie for a large set
+ * and Aho-Corasick otherwise. Returns the reason of the choice for --explain, or NULL with index_error if the engine
+ * given by --engine does not fit the keywords.
+ */
+const char* trie_select_engine()
+{
+    size_t count = trie_keywords_count();
+    const char* reason = "selected by --engine";
+    if (trie.engine == TRIE_ENGINE_AUTO)
+    {
+        if (count == 1 && !trie.case_insensitive)
+        {
+            trie.engine = TRIE_ENGINE_MEMMEM;
+            reason = "a single substring is found by its first and last bytes with SIMD, the trie is not walked";
+        }
+        else if (trie.length > TRIE_AUTO_MAX_AHO_CORASICK_NODES)
+        {
+            trie.engine = TRIE_ENGINE_TRIE;
+            reason = "the trie is too large for the cache, failure links would add a cache miss to every step";
+        }
+        else
+        {
+            trie.engine = TRIE_ENGINE_AHO_CORASICK;
+            reason = count == 1
+                ? "the case-insensitive search of a single substring needs an automaton that folds the input"
+                : "the automaton scans every byte of a line once";
+        }
+    }
+
+    if (trie.engine == TRIE_ENGINE_MEMMEM)
+    {
+        if (count != 1 || trie.case_insensitive)
+        {
+            index_fail("The memmem engine searches for a single case-sensitive substring");
+            return NULL;
+        }
+        string_expand(&trie.keyword, trie.max_length);
+        trie.keyword.length = 0;
+        for (uint32_t idx = 0; idx != TRIE_NULL_IDX && trie.keyword.length < trie.max_length && !trie_node_is_empty(trie.nodes[idx]); idx = trie.nodes[idx].idx_child)
+        {
+            trie.keyword.data[trie.keyword.length++] = trie.nodes[idx].c;
+            if (trie.nodes[idx].leaf)
+                break;
+        }
+    }
+    return reason;
+}
+
+/**
+ * Finds the shortest and the average length of the keywords with a breadth-first traversal
+ */
+void trie_keyword_lengths(size_t* min_length, double* average_length)
+{
+    *min_length = 0;
+    *average_length = 0;
+    uint32_t* queue = malloc_or_fatal(sizeof(uint32_t) * (trie.length > 0 ? trie.length : 1));
+    size_t queue_length = trie_linked_list_collect(0, queue);
+    size_t level_end = queue_length;
+    size_t depth = 1;
+    size_t count = 0;
+    size_t total = 0;
+    for (size_t queue_offset = 0; queue_offset < queue_length; queue_offset++)
+    {
+        struct trie_node node = trie.nodes[queue[queue_offset]];
+        if (node.leaf)
+        {
+            if (count++ == 0)
+                *min_length = depth;
+            total += depth;
+        }
+        queue_length += trie_linked_list_collect(node.idx_child, queue + queue_length);
+        if (queue_offset + 1 == level_end)
+        {
+            level_end = queue_length;
+            depth++;
+        }
+    }
+    free(queue);
+    if (count > 0)
+        *average_length = (double)total / count;
+}
+
+/**
+ * Prints the analysis of the keywords and what was chosen for them, see --explain
+ */
+void trie_explain(const char* engine_reason, bool prefilter_enabled)
+{
+    size_t min_length;
+    double average_length;
+    trie_keyword_lengths(&min_length, &average_length);
+    uint32_t list[TRIE_BITMAP_MASK + 1];
+    size_t fanout = trie_linked_list_collect(0, list);
+    fprintf(stderr, "Substrings: %zu, %zu to %zu bytes long, %.2f on average, %zu distinct first bytes\n",
+        trie_keywords_count(), min_length, trie.max_length, average_length, fanout);
+    fprintf(stderr, "Trie: %zu nodes, %zu dense nodes with a lookup table in the first %d levels\n",
+        trie.length, trie.tables_length, TRIE_DENSE_MAX_DEPTH);
+    fprintf(stderr, "Engine: %s, %s\n", trie_engine_names[trie.engine], engine_reason);
+    if (trie.engine == TRIE_ENGINE_TRIE)
+    {
+        fprintf(stderr, trie.length >= TRIE_BATCH_MIN_NODES
+            ? "Walks: %d at a time, so their cache misses overlap\n"
+            : "Walks: one at a time, interleaving them pays off only on a trie out of the cache\n", TRIE_BATCH_SIZE);
+    }
+    if (trie.engine == TRIE_ENGINE_MEMMEM)
+        fprintf(stderr, "Prefilter: not used by the memmem engine\n");
+    else if (!prefilter_enabled)
+        fprintf(stderr, "Prefilter: disabled by --no-prefilter\n");
+    else if (trie.prefilter.length == 0)
+    {
+        fprintf(stderr, "Prefilter: disabled, %.3g%% of the offsets of a random text would pass, over %.0f%%\n",
+            trie.prefilter.candidate_rate * 100.0, PREFILTER_MAX_CANDIDATE_RATE * 100.0);
+    }
+    else
+    {
+        fprintf(stderr, "Prefilter: the first %zu bytes, %.3g%% of the offsets of a random text pass. It is paused while "
+            "it skips fewer than %d bytes per call in the input\n",
+            trie.prefilter.length, trie.prefilter.candidate_rate * 100.0, PREFILTER_MIN_SKIP);
+    }
+}
+
+void trie_destroy()
+{
+    if (trie.loaded)
+        fstream_destroy(&trie.index_stream);
+    else
+    {
+        trie_array_free(trie.nodes, TRIE_NODE_SIZE * trie.capacity);
+        free(trie.bitmaps);
+        free(trie.tables);
+    }
+    trie.nodes = NULL;
+    trie.bitmaps = NULL;
+    trie.tables = NULL;
+    if (!trie.automaton_loaded)
+    {
+        trie_array_free(trie.idx_fail, sizeof(uint32_t) * trie.length);
+        trie_array_free(trie.idx_output, sizeof(uint32_t) * trie.length);
+        trie_array_free(trie.depth, sizeof(uint32_t) * trie.length);
+    }
+    trie.idx_fail = NULL;
+    trie.idx_output = NULL;
+    trie.depth = NULL;
+    string_destroy(&trie.keyword);
+}
+
+/**
+ * Hit counters of the keywords, collected with --keyword-stats. Every leaf of the trie is given a dense keyword ID,
+ * so the counters are a plain array. Every thread counts into its own array, which is added to the total when
+ * the thread finishes.
+ */
+struct
+{
+    bool enabled;
+
+    /**
+     * Keyword ID of every node, TRIE_NULL_IDX for the nodes that are not leaves
+     */
+    uint32_t* ids;
+    size_t count;
+
+    size_t* hits;
+    pthread_mutex_t mutex;
+} keyword_stats;
+
+static _Thread_local size_t* keyword_stats_local;
+
+/**
+ * Numbers the leaves in the order of the nodes. It works the same for a built and a loaded index, so the IDs
+ * do not have to be stored in the index file.
+ */
+void keyword_stats_init(bool enabled)
+{
+    keyword_stats.enabled = enabled;
+    keyword_stats.ids = NULL;
+    keyword_stats.count = 0;
+    keyword_stats.hits = NULL;
+    if (!enabled)
+        return;
+    keyword_stats.ids = malloc_or_fatal(sizeof(uint32_t) * trie.length);
+    for (size_t idx = 0; idx < trie.length; idx++)
+        keyword_stats.ids[idx] = trie.nodes[idx].leaf ? keyword_stats.count++ : TRIE_NULL_IDX;
+    keyword_stats.hits = malloc_or_fatal(sizeof(size_t) * (keyword_stats.count > 0 ? keyword_stats.count : 1));
+    memset(keyword_stats.hits, 0, sizeof(size_t) * keyword_stats.count);
+    pthread_mutex_init(&keyword_stats.mutex, NULL);
+}
+
+/**
+ * Counts a hit of the keyword that has been matched. The matchers only return the position of the match,
+ * so the leaf is found by walking the trie once more, which happens only for the matches and only with --keyword-stats.
+ */
+void keyword_stats_add(struct string keyword)
+{
+    uint32_t idx = 0;
+    uint32_t idx_leaf = TRIE_NULL_IDX;
+    for (size_t i = 0; i < keyword.length && idx != TRIE_NULL_IDX; i++)
+    {
+        idx_leaf = trie_linked_list_find(idx, trie_fold(keyword.data[i], trie.case_insensitive), false);
+        if (idx_leaf == TRIE_NULL_IDX)
+            return;
+        idx = trie.nodes[idx_leaf].idx_child;
+    }
+    if (idx_leaf == TRIE_NULL_IDX || !trie.nodes[idx_leaf].leaf)
+        return;
+    if (keyword_stats_local == NULL)
+    {
+        keyword_stats_local = malloc_or_fatal(sizeof(size_t) * keyword_stats.count);
+        memset(keyword_stats_local, 0, sizeof(size_t) * keyword_stats.count);
+    }
+    keyword_stats_local[keyword_stats.ids[idx_leaf]]++;
+}
+
+/**
+ * Adds the counters of the calling thread to the total
+ */
+void keyword_stats_merge()
+{
+    if (keyword_stats_local == NULL)
+        return;
+    pthread_mutex_lock(&keyword_stats.mutex);
+    for (size_t i = 0; i < keyword_stats.count; i++)
+        keyword_stats.hits[i] += keyword_stats_local[i];
+    pthread_mutex_unlock(&keyword_stats.mutex);
+    free(keyword_stats_local);
+    keyword_stats_local = NULL;
+}
+
+struct keyword_stats_entry
+{
+    /**
+     * Position of the keyword in the buffer of the restored keywords
+     */
+    size_t offset;
+    size_t length;
+
+    size_t hits;
+    uint32_t id;
+};
+
+int keyword_stats_entry_compare(const void* a, const void* b)
+{
+    const struct keyword_stats_entry* x = a;
+    const struct keyword_stats_entry* y = b;
+    if (x->hits != y->hits)
+        return (x->hits < y->hits) - (x->hits > y->hits);
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * Writes every keyword with the number of its hits as KEYWORD<TAB>COUNT, the most frequent ones first.
+ * The keywords are restored from the trie, so they are lowercase in a case-insensitive index.
+ */
+void keyword_stats_write(unsigned char* filename)
+{
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
+    if (file < 0)
+        fatal("No access to file %s", filename);
+
+    // Depth-first traversal with an explicit stack, the path holds the characters of the current keyword prefix
+    struct keyword_stats_entry* entries = malloc_or_fatal(sizeof(struct keyword_stats_entry) * (keyword_stats.count > 0 ? keyword_stats.count : 1));
+    size_t entries_count = 0;
+    struct string path = string_init();
+    struct string texts = string_init();
+    size_t texts_length = 0;
+    uint32_t* stack = malloc_or_fatal(sizeof(uint32_t) * trie.length * 2);
+    size_t stack_length = 0;
+    uint32_t list[TRIE_BITMAP_MASK + 1];
+    size_t list_length = trie_linked_list_collect(0, list);
+    for (size_t i = list_length; i > 0; i--)
+    {
+        stack[stack_length++] = list[i - 1];
+        stack[stack_length++] = 0;
+    }
+    while (stack_length > 0)
+    {
+        size_t depth = stack[--stack_length];
+        uint32_t idx = stack[--stack_length];
+        struct trie_node node = trie.nodes[idx];
+        if (path.length < depth + 1)
+            string_expand(&path, (depth + 1) * 2);
+        path.data[depth] = node.c;
+        if (node.leaf)
+        {
+            uint32_t id = keyword_stats.ids[idx];
+            entries[entries_count++] = (struct keyword_stats_entry) {texts_length, depth + 1, keyword_stats.hits[id], id};
+            string_append(&texts, &texts_length, (struct string) {path.data, depth + 1});
+        }
+        list_length = trie_linked_list_collect(node.idx_child, list);
+        for (size_t i = list_length; i > 0; i--)
+        {
+            stack[stack_length++] = list[i - 1];
+            stack[stack_length++] = depth + 1;
+        }
+    }
+    free(stack);
+    string_destroy(&path);
+
+    qsort(entries, entries_count, sizeof(struct keyword_stats_entry), keyword_stats_entry_compare);
+    struct ostream stream = ostream_init(file, OSTREAM_BUFFER_DEFAULT_CAPACITY);
+    for (size_t i = 0; i < entries_count; i++)
+    {
+        char count[32];
+        int length = sprintf(count, "\t%zu\n", entries[i].hits);
+        ostream_write(&stream, texts.data + entries[i].offset, entries[i].length);
+        ostream_write(&stream, count, length);
+    }
+    ostream_destroy(&stream);
+    close(file);
+    free(entries);
+    string_destroy(&texts);
+}
+
+void keyword_stats_destroy()
+{
+    if (!keyword_stats.enabled)
+        return;
+    free(keyword_stats.ids);
+    free(keyword_stats.hits);
+    keyword_stats.ids = NULL;
+    keyword_stats.hits = NULL;
+    pthread_mutex_destroy(&keyword_stats.mutex);
+}
+
+/**
+ * Wall-clock time in seconds
+ */
+double time_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void format_size(size_t size, char* buffer)
+{
+    if ((size >> 11) == 0)
+        sprintf(buffer, "%zu", size);
+    else if ((size >> 21) == 0)
+    {
+        float k = (float) size / 1024.0f;
+        sprintf(buffer, "%.2fK", k);
+    }
+    else if ((size >> 31) == 0)
+    {
+        float m = (float) size / (1024.0f * 1024.0f);
+        sprintf(buffer, "%.2fM", m);
+    }
+    else
+    {
+        float g = (float) size / (1024.0f * 1024.0f * 1024.0f);
+        sprintf(buffer, "%.2fG", g);
+    }
+}
+
+/**
+ * Parses a single character or one of the escapes \\0, \\t, \\n, \\r, \\\\ and \\xHH
+ */
+bool parse_delimiter(const char* str, unsigned char* delimiter)
+{
+    if (str[0] != '\\' || str[1] == '\0')
+    {
+        *delimiter = str[0];
+        return str[0] != '\0' && str[1] == '\0';
+    }
+    if (str[1] == 'x')
+    {
+        char* end;
+        unsigned long value = strtoul(str + 2, &end, 16);
+        *delimiter = value;
+        return isxdigit((unsigned char)str[2]) && *end == '\0' && end - str <= 4;
+    }
+    switch (str[1])
+    {
+    case '0':
+        *delimiter = '\0';
+        break;
+    case 't':
+        *delimiter = '\t';
+        break;
+    case 'n':
+        *delimiter = '\n';
+        break;
+    case 'r':
+        *delimiter = '\r';
+        break;
+    case '\\':
+        *delimiter = '\\';
+        break;
+    default:
+        return false;
+    }
+    return str[2] == '\0';
+}
+
+bool parse_size(const char* str, size_t* size)
+{
+    // strtoull() would accept a sign and negate the value
+    if (*str < '0' || *str > '9')
+        return false;
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno == ERANGE || value > SIZE_MAX)
+        return false;
+
+    // A size that does not fit is rejected rather than wrapped around
+    switch (*end)
+    {
+    case 'G':
+        if (value > SIZE_MAX / 1024)
+            return false;
+        value *= 1024;
+        __attribute__((fallthrough));
+    case 'M':
+        if (value > SIZE_MAX / 1024)
+            return false;
+        value *= 1024;
+        __attribute__((fallthrough));
+    case 'K':
+        if (value > SIZE_MAX / 1024)
+            return false;
+        value *= 1024;
+        end++;
+    }
+    if (*end != '\0')
+        return false;
+    *size = value;
+    return true;
+}
+
+char* build_progress_str(size_t processed, size_t size)
+{
+    static char buffer[1024];
+
+    char processed_str[256];
+    char size_str[256];
+    format_size(processed, processed_str);
+    format_size(size, size_str);
+    
+    // Progress bar
+    char progress_str[256] = "";
+    if (size > 0)
+    {
+        const int progress_bar_len = 32;
+        char progress_bar[progress_bar_len + 1];
+        float progress = (float) processed / (float) size;
+        memset(progress_bar, ' ', progress_bar_len);
+        progress_bar[0] = progress_bar[progress_bar_len - 1] = '|';
+        progress_bar[progress_bar_len] = '\0';
+        for (int i = 0; i < (progress_bar_len - 2) * progress; i++)
+            progress_bar[i + 1] = '*';
+        sprintf(progress_str, "%s %.2f%%   ", progress_bar, progress * 100.0f);
+    }
+
+    sprintf(buffer, "%s%s / %s", progress_str, processed_str, size > 0 ? size_str : "?");
+
+    return buffer;
+}
+
+enum progress_format
+{
+    PROGRESS_NONE,
+    PROGRESS_BAR,
+    PROGRESS_JSON
+};
+
+const char* progress_format_names[] = {"none", "bar", "json"};
+
+#define PROGRESS_INTERVAL_SECONDS 1
+
+/**
+ * Progress of the search. The writer adds the bytes of every chunk to the counter, a reporter thread
+ * prints it once a second, so the cost of the progress-bar does not depend on the number of lines.
+ */
+struct
+{
+    enum progress_format format;
+    FILE* file;
+
+    /**
+     * Bytes written and the total of the input, updated with atomic operations
+     */
+    size_t processed;
+    size_t size;
+
+    double start;
+    size_t prevlength;
+    bool stopped;
+    pthread_t reporter;
+    pthread_mutex_t mutex;
+    pthread_cond_t stopped_cond;
+} progress;
+
+void format_duration(double seconds, char* buffer)
+{
+    size_t total = seconds;
+    sprintf(buffer, "%zu:%02zu:%02zu", total / 3600, total / 60 % 60, total % 60);
+}
+
+void progress_print(bool done)
+{
+    size_t processed = __atomic_load_n(&progress.processed, __ATOMIC_RELAXED);
+    size_t size = __atomic_load_n(&progress.size, __ATOMIC_RELAXED);
+    // The size is not known for standard input and compressed files, and a file may grow during the search
+    if (size != 0 && (processed > size || done))
+        size = processed;
+    double elapsed = time_now() - progress.start;
+    double rate = elapsed > 0 ? processed / elapsed : 0;
+    bool known = size > 0 && rate > 0;
+    double eta = known ? (size - processed) / rate : 0;
+
+    if (progress.format == PROGRESS_JSON)
+    {
+        fprintf(progress.file, "{\"processed\":%zu,\"total\":", processed);
+        fprintf(progress.file, size > 0 ? "%zu" : "null", size);
+        fprintf(progress.file, ",\"elapsed\":%.3f,\"rate\":%.0f,\"eta\":", elapsed, rate);
+        fprintf(progress.file, known ? "%.3f" : "null", eta);
+        fprintf(progress.file, ",\"done\":%s}\n", done ? "true" : "false");
+        fflush(progress.file);
+        return;
+    }
+
+    char line[1024];
+    char rate_str[32];
+    format_size(rate, rate_str);
+    size_t length = sprintf(line, "%s   %s/s", build_progress_str(processed, size), rate_str);
+    if (known && !done)
+    {
+        char eta_str[32];
+        format_duration(eta, eta_str);
+        length += sprintf(line + length, "   ETA %s", eta_str);
+    }
+    fprintf(progress.file, "\r%s", line);
+    if (progress.prevlength > length)
+        fprintf(progress.file, "%*s", (int)(progress.prevlength - length), "");
+    fflush(progress.file);
+    progress.prevlength = length;
+}
+
+void* progress_reporter(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&progress.mutex);
+    while (!progress.stopped)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PROGRESS_INTERVAL_SECONDS;
+        while (!progress.stopped && pthread_cond_timedwait(&progress.stopped_cond, &progress.mutex, &deadline) != ETIMEDOUT);
+        if (!progress.stopped)
+            progress_print(false);
+    }
+    pthread_mutex_unlock(&progress.mutex);
+    return NULL;
+}
+
+/**
+ * Starts the reporter. The progress goes to file, which is standard output only if the output is redirected.
+ */
+void progress_init(enum progress_format format, FILE* file)
+{
+    progress.format = format;
+    progress.file = file;
+    progress.processed = 0;
+    progress.size = 0;
+    progress.prevlength = 0;
+    progress.stopped = false;
+    if (format == PROGRESS_NONE)
+        return;
+    progress.start = time_now();
+    pthread_mutex_init(&progress.mutex, NULL);
+    pthread_cond_init(&progress.stopped_cond, NULL);
+    if (pthread_create(&progress.reporter, NULL, progress_reporter, NULL) != 0)
+        fatal("Failed to create a thread");
+}
+
+/**
+ * Counts the bytes of a chunk. The total may change while the files are opened.
+ */
+static inline void progress_add(size_t bytes, size_t size)
+{
+    if (progress.format == PROGRESS_NONE)
+        return;
+    __atomic_fetch_add(&progress.processed, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress.size, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stops the reporter and prints the final progress
+ */
+void progress_destroy()
+{
+    if (progress.format == PROGRESS_NONE)
+        return;
+    pthread_mutex_lock(&progress.mutex);
+    progress.stopped = true;
+    pthread_cond_signal(&progress.stopped_cond);
+    pthread_mutex_unlock(&progress.mutex);
+    pthread_join(progress.reporter, NULL);
+    progress_print(true);
+    if (progress.format == PROGRESS_BAR)
+        fprintf(progress.file, "\n");
+    pthread_mutex_destroy(&progress.mutex);
+    pthread_cond_destroy(&progress.stopped_cond);
+}
+
+/**
+ * Decides whether the line goes to the output. If it does, selected receives either the entire line or the matched substring.
+ */
+bool filter_line(struct string line, struct trie_match match, bool invert, bool print_match, struct string* selected)
+{
+    bool matches = match.length > 0;
+    if (!(matches ^ invert))
+        return false;
+    *selected = print_match
+        ? string_sub(line, match.offset, match.length)
+        : line;
+    return true;
+}
+
+struct file_entry
+{
+    /**
+     * Path of the file, NULL for standard input
+     */
+    unsigned char* name;
+    size_t size;
+    bool regular;
+};
+
+/**
+ * Input files in the order they are searched
+ */
+struct file_list
+{
+    struct file_entry* data;
+    size_t length;
+    size_t capacity;
+};
+
+struct file_list file_list_init()
+{
+    struct file_list list;
+    memset(&list, 0, sizeof(struct file_list));
+    return list;
+}
+
+/**
+ * Adds a copy of the name to the list. NULL stands for standard input.
+ */
+void file_list_add(struct file_list* list, const unsigned char* name, size_t size, bool regular)
+{
+    if (list->length == list->capacity)
+    {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        list->data = realloc_or_fatal(list->data, sizeof(struct file_entry) * list->capacity);
+    }
+    struct file_entry* entry = &list->data[list->length++];
+    entry->name = NULL;
+    if (name != NULL)
+    {
+        size_t length = strlen(name) + 1;
+        entry->name = malloc_or_fatal(length);
+        memcpy(entry->name, name, length);
+    }
+    entry->size = size;
+    entry->regular = regular;
+}
+
+int file_name_compare(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/**
+ * Adds the file to the list, or the files of the directory if recursive is set. Files of a directory are visited
+ * in the order of their names, so the output does not depend on the file system. Symbolic links and special files
+ * found in directories are skipped, the ones given explicitly are searched.
+ */
+void file_list_add_path(struct file_list* list, const unsigned char* path, bool recursive, bool nested)
+{
+    struct stat stat_buffer;
+    if ((nested ? lstat(path, &stat_buffer) : stat(path, &stat_buffer)) < 0)
+        fatal("No access to file %s", path);
+    if (!S_ISDIR(stat_buffer.st_mode))
+    {
+        bool regular = S_ISREG(stat_buffer.st_mode);
+        if (regular || !nested)
+            file_list_add(list, path, regular ? stat_buffer.st_size : 0, regular);
+        return;
+    }
+    if (!recursive)
+        fatal("%s is a directory, use --recursive to search in it", path);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        fatal("No access to directory %s", path);
+    size_t path_length = strlen(path);
+    bool separator = path_length > 0 && path[path_length - 1] != '/';
+    unsigned char** names = NULL;
+    size_t names_count = 0;
+    size_t names_capacity = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+            continue;
+        if (names_count == names_capacity)
+        {
+            names_capacity = names_capacity > 0 ? names_capacity * 2 : 16;
+            names = realloc_or_fatal(names, sizeof(unsigned char*) * names_capacity);
+        }
+        size_t name_length = strlen(dirent->d_name);
+        unsigned char* name = malloc_or_fatal(path_length + separator + name_length + 1);
+        memcpy(name, path, path_length);
+        if (separator)
+            name[path_length] = '/';
+        memcpy(name + path_length + separator, dirent->d_name, name_length + 1);
+        names[names_count++] = name;
+    }
+    closedir(dir);
+
+    qsort(names, names_count, sizeof(unsigned char*), file_name_compare);
+    for (size_t i = 0; i < names_count; i++)
+    {
+        file_list_add_path(list, names[i], true, true);
+        free(names[i]);
+    }
+    free(names);
+}
+
+void file_list_destroy(struct file_list* list)
+{
+    for (size_t i = 0; i < list->length; i++)
+        free(list->data[i].name);
+    free(list->data);
+    list->data = NULL;
+    list->length = 0;
+}
+
+#define POOL_CHUNKS_PER_THREAD 2
+
+/**
+ * Number of chunks the reader thread may fill ahead of the ones being matched and written
+ */
+#define POOL_READ_AHEAD_CHUNKS 2
+#define POOL_BATCH_LINES 64
+
+/**
+ * Files up to this size are read whole and batched together into a single chunk
+ */
+#define POOL_SMALL_FILE_SIZE 256 * 1024
+
+/**
+ * Lines of one file in a chunk
+ */
+struct pool_segment
+{
+    struct string filename;
+
+    /**
+     * Position of the lines in the chunk
+     */
+    size_t offset;
+    size_t length;
+
+    /**
+     * Offset of the lines from the start of the file
+     */
+    size_t file_offset;
+};
+
+struct pool_chunk
+{
+    /**
+     * Buffer exchanged with the input stream
+     */
+    struct string input;
+
+    /**
+     * Complete lines read from the input, a slice of the input buffer
+     */
+    struct string lines;
+
+    /**
+     * Files the lines belong to. A chunk is either a part of one file or a batch of small files.
+     */
+    struct pool_segment* segments;
+    size_t segments_count;
+    size_t segments_capacity;
+
+    /**
+     * Lines or matches selected for the output
+     */
+    struct string output;
+    size_t output_length;
+
+    /**
+     * Number of the selected lines or, with --all-matches, of the matches
+     */
+    size_t count;
+
+    /**
+     * Matches of the current line, used with --all-matches
+     */
+    struct trie_matches matches;
+
+    /**
+     * Set if the chunk continues a line of the stream that is too long to be read at once, see fstream.piece_overlap.
+     * The first line of the chunk is then a further piece of it, and the overlap bytes repeat the end of the previous
+     * piece. An open chunk is a single piece of a line that goes on in the next chunk. The pieces are matched
+     * on their own, and the main thread joins their results as it writes the chunks in order.
+     */
+    bool line_continued;
+    bool line_open;
+    size_t line_overlap;
+
+    /**
+     * Length of the piece at the start of the chunk and whether it contains a keyword
+     */
+    size_t piece_length;
+    bool piece_matched;
+
+    /**
+     * Set by a worker once the output is ready to be written
+     */
+    bool matched;
+};
+
+/**
+ * Worker threads match chunks of the input against the shared trie. The main thread reads chunks into a ring
+ * and writes the results in the same order, so the output does not depend on the number of threads.
+ * Without worker threads the main thread matches every chunk itself. If the input is read with read(),
+ * a reader thread fills the chunks instead of the main thread, so the reading overlaps with the matching.
+ */
+struct
+{
+    pthread_t* threads;
+    size_t threads_count;
+    struct pool_chunk* chunks;
+    size_t chunks_count;
+
+    /**
+     * Number of chunks that are read or submitted but not written yet. The rest of the ring is filled ahead
+     * by the reader thread.
+     */
+    size_t window;
+
+    /**
+     * Input files and the number of them that have been opened
+     */
+    struct file_list* files;
+    size_t files_opened;
+
+    /**
+     * File that is read as a stream and the offset of the next lines in it
+     */
+    bool input_open;
+    struct fstream input_stream;
+    int input_file;
+    struct string input_filename;
+    size_t input_offset;
+
+    /**
+     * Total of the progress-bar, the sum of the sizes of the files. Compressed files are not counted.
+     */
+    size_t input_size;
+
+    bool read_ahead;
+    pthread_t reader;
+
+    /**
+     * Number of chunks filled by the reader thread, including the empty one at the end of the input
+     */
+    size_t chunks_read;
+
+    size_t chunks_written;
+
+    /**
+     * Sequence number of the next chunk to be taken by a worker
+     */
+    size_t chunks_taken;
+
+    /**
+     * Number of chunks submitted by the main thread
+     */
+    size_t chunks_submitted;
+
+    bool stopped;
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted_cond;
+    pthread_cond_t matched_cond;
+    pthread_cond_t read_cond;
+    pthread_cond_t written_cond;
+
+    bool invert;
+    bool print_match;
+    bool all_matches;
+    bool longest;
+
+    /**
+     * If set, the selected lines or matches are only counted
+     */
+    bool count;
+
+    /**
+     * If set, every output line starts with the name of its file
+     */
+    bool with_filename;
+
+    /**
+     * If set, a line selected at the end of a file without a line break gets one, so the output of the next file
+     * or the next prefix does not continue it
+     */
+    bool terminate_lines;
+
+    /**
+     * Sum of the counts of the written chunks
+     */
+    size_t count_total;
+
+    /**
+     * Overlap of the pieces of long lines in the input streams, 0 if the lines are read whole. Printing the matches
+     * and counting the keywords need the entire line.
+     */
+    size_t piece_overlap;
+
+    /**
+     * The long line the main thread is writing the pieces of and whether any of them matched so far. Until one does,
+     * the pieces are spilled into a temporary file, since it is not known yet whether the line is selected.
+     */
+    bool piece_line_open;
+    bool piece_line_matched;
+    unsigned char piece_line_last;
+    struct string piece_line_filename;
+    FILE* spill;
+} pool;
+
+void pool_output_filename(struct pool_chunk* chunk, struct pool_segment* segment)
+{
+    if (!pool.with_filename)
+        return;
+    string_append(&chunk->output, &chunk->output_length, segment->filename);
+    string_append(&chunk->output, &chunk->output_length, (struct string) {":", 1});
+}
+
+/**
+ * Adds every match of the line to the output as OFFSET:MATCH, where OFFSET is counted from the start of the file
+ */
+void pool_output_all_matches(struct pool_chunk* chunk, struct pool_segment* segment, struct string line, size_t line_offset)
+{
+    for (size_t i = 0; i < chunk->matches.length; i++)
+    {
+        struct trie_match match = chunk->matches.data[i];
+        char prefix[32];
+        int length = sprintf(prefix, "%zu:", segment->file_offset + line_offset + match.offset);
+        pool_output_filename(chunk, segment);
+        string_append(&chunk->output, &chunk->output_length, (struct string) {prefix, length});
+        string_append(&chunk->output, &chunk->output_length, string_sub(line, match.offset, match.length));
+        string_append(&chunk->output, &chunk->output_length, (struct string) {&trie.delimiter, 1});
+    }
+}
+
+void pool_match_segment(struct pool_chunk* chunk, struct pool_segment* segment, size_t* lines_count, size_t* lines_matched)
+{
+    struct string input = string_sub(chunk->lines, segment->offset, segment->length);
+    struct string lines[POOL_BATCH_LINES];
+    struct trie_match matches[POOL_BATCH_LINES];
+    size_t offset = 0;
+
+    // Only the printed or counted match depends on where it starts
+    bool leftmost = (pool.print_match && !pool.count) || keyword_stats.enabled;
+    while (offset < input.length)
+    {
+        // Lines are matched in batches, so the matcher may scan several of them together
+        size_t count = 0;
+        size_t lines_offset = offset;
+        for (; count < POOL_BATCH_LINES && offset < input.length; count++)
+        {
+            void* delimptr = _memchr(input.data + offset, trie.delimiter, input.length - offset);
+            size_t length = delimptr != NULL
+                ? delimptr - (void*)input.data - offset + 1
+                : input.length - offset;
+            lines[count] = string_sub(input, offset, length);
+            offset += length;
+        }
+        *lines_count += count;
+
+        if (pool.all_matches)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                trie_find_all_matches(lines[i], pool.longest, &chunk->matches);
+                *lines_matched += chunk->matches.length > 0;
+                chunk->count += chunk->matches.length;
+                for (size_t k = 0; k < chunk->matches.length && keyword_stats.enabled; k++)
+                    keyword_stats_add(string_sub(lines[i], chunk->matches.data[k].offset, chunk->matches.data[k].length));
+                if (!pool.count)
+                    pool_output_all_matches(chunk, segment, lines[i], lines_offset);
+                lines_offset += lines[i].length;
+            }
+            continue;
+        }
+
+        trie_find_matches(lines, count, leftmost, pool.longest, matches);
+        for (size_t i = 0; i < count; i++)
+        {
+            *lines_matched += matches[i].length > 0;
+            if (keyword_stats.enabled && matches[i].length > 0)
+                keyword_stats_add(string_sub(lines[i], matches[i].offset, matches[i].length));
+            struct string selected;
+            if (!filter_line(lines[i], matches[i], pool.invert, pool.print_match, &selected))
+                continue;
+            chunk->count++;
+            if (pool.count)
+                continue;
+            pool_output_filename(chunk, segment);
+            string_append(&chunk->output, &chunk->output_length, selected);
+            if (pool.print_match || (pool.terminate_lines && selected.data[selected.length - 1] != trie.delimiter))
+                string_append(&chunk->output, &chunk->output_length, (struct string) {&trie.delimiter, 1});
+        }
+    }
+}
+
+/**
+ * Checks the piece of a long line at the start of the chunk for a match and leaves the complete lines after it
+ * to the segment. The long line is counted in the statistics by the main thread.
+ */
+void pool_match_piece(struct pool_chunk* chunk)
+{
+    // A piece is returned only from a buffer that holds no line break, so an open chunk is a piece as a whole
+    struct pool_segment* segment = &chunk->segments[0];
+    size_t length = chunk->lines.length;
+    if (!chunk->line_open)
+    {
+        void* delimptr = _memchr(chunk->lines.data, trie.delimiter, chunk->lines.length);
+        if (delimptr != NULL)
+            length = delimptr - (void*)chunk->lines.data + 1;
+    }
+    chunk->piece_length = length;
+    chunk->piece_matched = trie_find_match(string_sub(chunk->lines, 0, length), false, false).length > 0;
+    segment->offset = length;
+    segment->length = chunk->lines.length - length;
+    segment->file_offset += length;
+}
+
+void pool_match_chunk(struct pool_chunk* chunk)
+{
+    double start = stats.enabled ? time_now() : 0;
+    chunk->output_length = 0;
+    chunk->count = 0;
+    size_t lines_count = 0;
+    size_t lines_matched = 0;
+    if (chunk->line_continued || chunk->line_open)
+        pool_match_piece(chunk);
+    for (size_t i = 0; i < chunk->segments_count; i++)
+        pool_match_segment(chunk, &chunk->segments[i], &lines_count, &lines_matched);
+    if (stats.enabled)
+    {
+        stats_local.bytes += chunk->lines.length - chunk->line_overlap;
+        stats_local.lines += lines_count;
+        stats_local.lines_matched += lines_matched;
+        stats_local.match_seconds += time_now() - start;
+    }
+}
+
+void* pool_worker(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.mutex);
+    while (true)
+    {
+        while (pool.chunks_taken == pool.chunks_submitted && !pool.stopped)
+            pthread_cond_wait(&pool.submitted_cond, &pool.mutex);
+        if (pool.chunks_taken == pool.chunks_submitted)
+            break;
+        struct pool_chunk* chunk = &pool.chunks[pool.chunks_taken++ % pool.chunks_count];
+        pthread_mutex_unlock(&pool.mutex);
+
+        pool_match_chunk(chunk);
+
+        pthread_mutex_lock(&pool.mutex);
+        chunk->matched = true;
+        pthread_cond_broadcast(&pool.matched_cond);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    if (stats.enabled)
+        stats_merge();
+    keyword_stats_merge();
+    return NULL;
+}
+
+int pool_open_file(struct file_entry* entry)
+{
+    if (entry->name == NULL)
+    {
+#ifdef _WIN32
+        setmode(STDIN_FILENO, O_BINARY);
+#endif /* _WIN32 */
+        return STDIN_FILENO;
+    }
+    int file = open(entry->name, O_RDONLY | O_BINARY);
+    if (file < 0)
+        fatal("No access to file %s", entry->name);
+    return file;
+}
+
+/**
+ * Makes the opened file the input stream. Only a single input file is mapped: the view of a file that has been
+ * read to the end has to stay alive until the chunks that refer to it are written, so it is released by pool_destroy.
+ */
+void pool_open_stream(struct file_entry* entry, int file, bool map)
+{
+    pool.input_stream = map && entry->regular
+        ? fstream_init_mapped(file, entry->size)
+        : fstream_init(file);
+    fstream_detect_compression(&pool.input_stream);
+    pool.input_stream.piece_overlap = pool.piece_overlap;
+    if (pool.input_stream.decoder != NULL)
+    {
+        // The size of the decompressed data is not known in advance
+        pthread_mutex_lock(&pool.mutex);
+        pool.input_size -= entry->size;
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    pool.input_file = file;
+    pool.input_filename = entry->name != NULL
+        ? (struct string) {entry->name, strlen(entry->name)}
+        : (struct string) {"(standard input)", strlen("(standard input)")};
+    pool.input_offset = 0;
+    pool.input_open = true;
+}
+
+void pool_close_input()
+{
+    fstream_destroy(&pool.input_stream);
+    if (pool.input_file != STDIN_FILENO)
+        close(pool.input_file);
+    pool.input_open = false;
+}
+
+/**
+ * Offset of the first line of the file that starts at the offset or after it
+ */
+size_t pool_align_offset(int file, size_t size, size_t offset)
+{
+    if (offset == 0 || offset >= size)
+        return offset < size ? offset : size;
+
+    // The line starts at the offset if the previous byte ends a line
+    unsigned char buffer[64 * 1024];
+    size_t position = offset - 1;
+    if (lseek(file, position, SEEK_SET) < 0)
+        fatal("Failed to read");
+    while (position < size)
+    {
+        size_t count = read_or_fatal(file, buffer, sizeof(buffer));
+        if (count == 0)
+            break;
+        void* delimptr = _memchr(buffer, trie.delimiter, count);
+        if (delimptr != NULL)
+            return position + (delimptr - (void*)buffer) + 1;
+        position += count;
+    }
+    return size;
+}
+
+/**
+ * Limits the input stream to the lines that start in the range of offsets. Every line belongs to the range
+ * its first byte is in, like in the input splits of Hadoop, so adjoining ranges of several nodes cover each line once.
+ */
+void pool_open_range(size_t start, size_t end)
+{
+    struct file_entry* entry = &pool.files->data[0];
+    if (pool.input_stream.decoder != NULL)
+        fatal("A range of compressed file %s cannot be searched", entry->name);
+    start = pool_align_offset(pool.input_file, entry->size, start);
+    end = pool_align_offset(pool.input_file, entry->size, end);
+    if (pool.input_stream.mapped)
+    {
+        pool.input_stream.buffer_offset = start;
+        pool.input_stream.buffer_size = end;
+    }
+    else
+    {
+        // The bytes read ahead to detect the compression are dropped too
+        if (lseek(pool.input_file, start, SEEK_SET) < 0)
+            fatal("Failed to read");
+        pool.input_stream.buffer_size = 0;
+        pool.input_stream.read_limit = end - start;
+    }
+    pool.input_offset = start;
+    pool.input_size = end - start;
+}
+
+void pool_init(size_t threads_count, struct file_list* files, bool no_mmap, bool invert, bool print_match, bool all_matches,
+    bool longest, bool count, bool with_filename, size_t range_start, size_t range_end)
+{
+    pool.threads_count = threads_count;
+    pool.window = threads_count > 0 ? threads_count * POOL_CHUNKS_PER_THREAD : 1;
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    pool.files = files;
+    pool.files_opened = 0;
+    pool.input_open = false;
+
+    // A match may cross the boundary of two pieces by the length of the longest keyword. The overlap is never empty,
+    // so the end of a long line always comes in a chunk of its own.
+    pool.piece_overlap = !print_match && !all_matches && !keyword_stats.enabled
+        ? (trie.max_length > 0 ? trie.max_length : 1)
+        : 0;
+    pool.piece_line_open = false;
+    pool.spill = NULL;
+    pool.input_size = 0;
+    for (size_t i = 0; i < files->length; i++)
+        pool.input_size += files->data[i].size;
+    if (files->length == 1)
+    {
+        struct file_entry* entry = &files->data[pool.files_opened++];
+        pool_open_stream(entry, pool_open_file(entry), entry->name != NULL && !no_mmap);
+        if (range_start > 0 || range_end != SIZE_MAX)
+            pool_open_range(range_start, range_end);
+    }
+
+    // A mapped input is only sliced, there is nothing to read ahead
+    pool.read_ahead = !pool.input_open || !pool.input_stream.mapped;
+    pool.chunks_count = pool.window + (pool.read_ahead ? POOL_READ_AHEAD_CHUNKS : 0);
+    pool.chunks = malloc_or_fatal(sizeof(struct pool_chunk) * pool.chunks_count);
+    for (size_t i = 0; i < pool.chunks_count; i++)
+    {
+        pool.chunks[i].input = string_init();
+        pool.chunks[i].segments = NULL;
+        pool.chunks[i].segments_capacity = 0;
+        pool.chunks[i].output = string_init();
+        pool.chunks[i].matches = trie_matches_init();
+    }
+    pool.chunks_taken = 0;
+    pool.chunks_submitted = 0;
+    pool.chunks_read = 0;
+    pool.chunks_written = 0;
+    pool.stopped = false;
+    pool.invert = invert;
+    pool.print_match = print_match;
+    pool.all_matches = all_matches;
+    pool.longest = longest;
+    pool.count = count;
+    pool.count_total = 0;
+    pool.with_filename = with_filename;
+    pool.terminate_lines = files->length > 1 || with_filename;
+    pthread_cond_init(&pool.submitted_cond, NULL);
+    pthread_cond_init(&pool.matched_cond, NULL);
+    pthread_cond_init(&pool.read_cond, NULL);
+    pthread_cond_init(&pool.written_cond, NULL);
+    pool.threads = malloc_or_fatal(sizeof(pthread_t) * threads_count);
+    for (size_t i = 0; i < threads_count; i++)
+    {
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) != 0)
+            fatal("Failed to create a thread");
+    }
+}
+
+void pool_add_segment(struct pool_chunk* chunk, struct string filename, size_t offset, size_t length, size_t file_offset)
+{
+    if (chunk->segments_count == chunk->segments_capacity)
+    {
+        chunk->segments_capacity = chunk->segments_capacity > 0 ? chunk->segments_capacity * 2 : 16;
+        chunk->segments = realloc_or_fatal(chunk->segments, sizeof(struct pool_segment) * chunk->segments_capacity);
+    }
+    chunk->segments[chunk->segments_count++] = (struct pool_segment) {filename, offset, length, file_offset};
+}
+
+/**
+ * Appends the entire small file to the batch in the chunk buffer. Returns false if the file is compressed,
+ * such a file is rewound to be read as a stream.
+ */
+bool pool_read_small_file(struct pool_chunk* chunk, struct file_entry* entry, int file, size_t* batched)
+{
+    size_t length = 0;
+    if (chunk->input.length < *batched + entry->size + 1)
+        string_expand(&chunk->input, *batched + entry->size + 1 > FSTREAM_BUFFER_INITIAL_CAPACITY ? (*batched + entry->size + 1) * 2 : FSTREAM_BUFFER_INITIAL_CAPACITY);
+    while (true)
+    {
+        // The file may have grown since it was listed
+        if (*batched + length == chunk->input.length)
+            string_expand(&chunk->input, chunk->input.length * 2);
+        size_t count = read_or_fatal(file, chunk->input.data + *batched + length, chunk->input.length - *batched - length);
+        if (count == 0)
+            break;
+        length += count;
+    }
+    if (compression_detect(chunk->input.data + *batched, length) != COMPRESSION_NONE)
+    {
+        lseek(file, 0, SEEK_SET);
+        return false;
+    }
+    if (length > 0)
+        pool_add_segment(chunk, (struct string) {entry->name, strlen(entry->name)}, *batched, length, 0);
+    *batched += length;
+    return true;
+}
+
+/**
+ * Fills the chunk with the next lines of the input stream or, if the next files are small, with a batch of them.
+ * Files are opened and closed here as the input goes on. The lines are empty at the end of the input.
+ */
+void pool_read_chunk(struct pool_chunk* chunk)
+{
+    double start = stats.enabled ? time_now() : 0;
+    chunk->lines = (struct string) {NULL, 0};
+    chunk->segments_count = 0;
+    chunk->line_continued = false;
+    chunk->line_open = false;
+    chunk->line_overlap = 0;
+    size_t batched = 0;
+    while (batched < FSTREAM_BUFFER_INITIAL_CAPACITY)
+    {
+        if (pool.input_open)
+        {
+            // A batch of small files is not mixed with the lines of a stream
+            if (batched > 0)
+                break;
+            struct string lines = fstream_read_lines(&pool.input_stream, &chunk->input, trie.delimiter);
+            if (lines.length > 0)
+            {
+                chunk->lines = lines;
+                chunk->line_continued = pool.input_stream.lines_continued;
+                chunk->line_open = pool.input_stream.lines_open;
+                chunk->line_overlap = chunk->line_continued ? pool.input_stream.piece_overlap : 0;
+                pool_add_segment(chunk, pool.input_filename, 0, lines.length, pool.input_offset - chunk->line_overlap);
+                pool.input_offset += lines.length - chunk->line_overlap;
+                break;
+            }
+            if (pool.input_stream.mapped)
+                break;
+            pool_close_input();
+            continue;
+        }
+        if (pool.files_opened == pool.files->length)
+            break;
+        struct file_entry* entry = &pool.files->data[pool.files_opened++];
+        int file = pool_open_file(entry);
+        if (entry->regular && entry->size <= POOL_SMALL_FILE_SIZE && pool_read_small_file(chunk, entry, file, &batched))
+            close(file);
+        else
+            pool_open_stream(entry, file, false);
+    }
+    if (batched > 0)
+        chunk->lines = (struct string) {chunk->input.data, batched};
+    if (stats.enabled)
+        stats_local.read_seconds += time_now() - start;
+}
+
+void* pool_reader(void* arg)
+{
+    (void)arg;
+    for (size_t seq = 0;; seq++)
+    {
+        // The slot is free once the chunk that took it before has been written out
+        pthread_mutex_lock(&pool.mutex);
+        while (seq >= pool.chunks_written + pool.chunks_count)
+            pthread_cond_wait(&pool.written_cond, &pool.mutex);
+        pthread_mutex_unlock(&pool.mutex);
+
+        struct pool_chunk* chunk = &pool.chunks[seq % pool.chunks_count];
+        pool_read_chunk(chunk);
+        bool eof = chunk->lines.length == 0;
+
+        pthread_mutex_lock(&pool.mutex);
+        pool.chunks_read = seq + 1;
+        pthread_cond_signal(&pool.read_cond);
+        pthread_mutex_unlock(&pool.mutex);
+        if (eof)
+            break;
+    }
+    if (stats.enabled)
+        stats_merge();
+    return NULL;
+}
+
+#define POOL_SPILL_BUFFER_SIZE 1024 * 1024
+
+void pool_spill(struct string piece)
+{
+    if (pool.spill == NULL && (pool.spill = tmpfile()) == NULL)
+        fatal("Failed to create a temporary file");
+    if (fwrite(piece.data, 1, piece.length, pool.spill) != piece.length)
+        fatal("Failed to write");
+}
+
+/**
+ * Writes the start of the long line: the file name and the spilled pieces
+ */
+void pool_write_spill(struct ostream* output_stream)
+{
+    if (pool.with_filename)
+    {
+        ostream_write(output_stream, pool.piece_line_filename.data, pool.piece_line_filename.length);
+        ostream_write(output_stream, ":", 1);
+    }
+    if (pool.spill == NULL)
+        return;
+    rewind(pool.spill);
+    void* buffer = malloc_or_fatal(POOL_SPILL_BUFFER_SIZE);
+    size_t count;
+    while ((count = fread(buffer, 1, POOL_SPILL_BUFFER_SIZE, pool.spill)) > 0)
+        ostream_write(output_stream, buffer, count);
+    if (ferror(pool.spill))
+        fatal("Failed to read");
+    free(buffer);
+}
+
+/**
+ * Writes the next piece of a long line, see pool_chunk.line_continued. Once a piece matches, the line is known
+ * to be selected or, with --invert, not to be, and the rest of it is written or dropped without spilling.
+ */
+void pool_write_piece(struct ostream* output_stream, struct pool_segment* segment, struct string piece, bool matched, bool end)
+{
+    if (!pool.piece_line_open)
+    {
+        pool.piece_line_open = true;
+        pool.piece_line_matched = false;
+        pool.piece_line_last = trie.delimiter;
+        pool.piece_line_filename = segment->filename;
+    }
+    if (matched && !pool.piece_line_matched && !pool.invert && !pool.count)
+        pool_write_spill(output_stream);
+    pool.piece_line_matched |= matched;
+    if (piece.length > 0)
+    {
+        pool.piece_line_last = piece.data[piece.length - 1];
+        if (!pool.count && !pool.piece_line_matched)
+            pool_spill(piece);
+        else if (!pool.count && !pool.invert)
+            ostream_write(output_stream, piece.data, piece.length);
+    }
+    if (!end)
+        return;
+
+    if (pool.piece_line_matched ^ pool.invert)
+    {
+        pool.count_total++;
+        if (!pool.count && pool.invert)
+            pool_write_spill(output_stream);
+        if (!pool.count && pool.terminate_lines && pool.piece_line_last != trie.delimiter)
+            ostream_write(output_stream, &trie.delimiter, 1);
+    }
+    if (stats.enabled)
+    {
+        stats_local.lines++;
+        stats_local.lines_matched += pool.piece_line_matched;
+    }
+    if (pool.spill != NULL)
+        fclose(pool.spill);
+    pool.spill = NULL;
+    pool.piece_line_open = false;
+}
+
+void pool_write_chunk(struct pool_chunk* chunk, struct ostream* output_stream)
+{
+    pthread_mutex_lock(&pool.mutex);
+    while (!chunk->matched)
+        pthread_cond_wait(&pool.matched_cond, &pool.mutex);
+    size_t input_size = pool.input_size;
+    pthread_mutex_unlock(&pool.mutex);
+
+    double start = stats.enabled ? time_now() : 0;
+    if (chunk->line_continued || chunk->line_open)
+    {
+        struct string piece = string_sub(chunk->lines, chunk->line_overlap, chunk->piece_length - chunk->line_overlap);
+        pool_write_piece(output_stream, &chunk->segments[0], piece, chunk->piece_matched, !chunk->line_open);
+    }
+    ostream_write(output_stream, chunk->output.data, chunk->output_length);
+    ostream_flush_interactive(output_stream);
+    pool.count_total += chunk->count;
+    if (stats.enabled)
+        stats_local.write_seconds += time_now() - start;
+    progress_add(chunk->lines.length - chunk->line_overlap, input_size);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.chunks_written++;
+    pthread_cond_signal(&pool.written_cond);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void pool_run(struct ostream* output_stream)
+{
+    if (pool.read_ahead && pthread_create(&pool.reader, NULL, pool_reader, NULL) != 0)
+        fatal("Failed to create a thread");
+
+    size_t seq = 0;
+    while (true)
+    {
+        struct pool_chunk* chunk = &pool.chunks[seq % pool.chunks_count];
+        if (pool.read_ahead)
+        {
+            pthread_mutex_lock(&pool.mutex);
+            while (pool.chunks_read <= seq)
+            {
+                // While the input is slower than matching, the chunks are written without waiting for the window
+                // to fill, so the lines of a pipe are written as they are found
+                if (pool.chunks_written < seq)
+                {
+                    pthread_mutex_unlock(&pool.mutex);
+                    pool_write_chunk(&pool.chunks[pool.chunks_written % pool.chunks_count], output_stream);
+                    pthread_mutex_lock(&pool.mutex);
+                    continue;
+                }
+                pthread_cond_wait(&pool.read_cond, &pool.mutex);
+            }
+            pthread_mutex_unlock(&pool.mutex);
+        }
+        else
+            pool_read_chunk(chunk);
+        if (chunk->lines.length == 0)
+            break;
+
+        if (pool.threads_count == 0)
+        {
+            pool_match_chunk(chunk);
+            chunk->matched = true;
+            seq++;
+        }
+        else
+        {
+            pthread_mutex_lock(&pool.mutex);
+            chunk->matched = false;
+            pool.chunks_submitted = ++seq;
+            pthread_cond_signal(&pool.submitted_cond);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+
+        // Chunks are written in the order of submission, the oldest one leaves the window
+        if (pool.chunks_written + pool.window <= seq)
+            pool_write_chunk(&pool.chunks[pool.chunks_written % pool.chunks_count], output_stream);
+    }
+
+    for (size_t seq_pending = pool.chunks_written; seq_pending < seq; seq_pending++)
+        pool_write_chunk(&pool.chunks[seq_pending % pool.chunks_count], output_stream);
+    if (pool.read_ahead)
+        pthread_join(pool.reader, NULL);
+}
+
+void pool_destroy()
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopped = true;
+    pthread_cond_broadcast(&pool.submitted_cond);
+    pthread_mutex_unlock(&pool.mutex);
+    for (size_t i = 0; i < pool.threads_count; i++)
+        pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+    pool.threads = NULL;
+
+    if (pool.input_open)
+        pool_close_input();
+
+    for (size_t i = 0; i < pool.chunks_count; i++)
+    {
+        string_destroy(&pool.chunks[i].input);
+        free(pool.chunks[i].segments);
+        string_destroy(&pool.chunks[i].output);
+        trie_matches_destroy(&pool.chunks[i].matches);
+    }
+    free(pool.chunks);
+    pool.chunks = NULL;
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.submitted_cond);
+    pthread_cond_destroy(&pool.matched_cond);
+    pthread_cond_destroy(&pool.read_cond);
+    pthread_cond_destroy(&pool.written_cond);
+}
+
+#define stats_ratio(a, b) ((b) > 0 ? (double) (a) / (double) (b) : 0.0)
+
+/**
+ * Prints the counters of the matching to stderr. The match time is summed over all threads.
+ */
+void stats_print()
+{
+    struct stats_counters* total = &stats.total;
+    char bytes[32];
+    format_size(total->bytes, bytes);
+    size_t bitmap_lookups = total->bitmap_rejected + total->bitmap_passed;
+    fprintf(stderr, "Input: %s in %zu lines, %zu lines matched\n", bytes, total->lines, total->lines_matched);
+    fprintf(stderr, "Matching: %.2f walks and %.2f hops per line\n",
+        stats_ratio(total->walks, total->lines), stats_ratio(total->hops, total->lines));
+    fprintf(stderr, "Bitmap filter: %zu lookups, %.2f%% passed, %.2f%% rejected\n", bitmap_lookups,
+        stats_ratio(total->bitmap_passed, bitmap_lookups) * 100.0, stats_ratio(total->bitmap_rejected, bitmap_lookups) * 100.0);
+    fprintf(stderr, "Time: read %.3f s, match %.3f s, write %.3f s\n", total->read_seconds, total->match_seconds, total->write_seconds);
+}
+
+struct options
+{
+    unsigned char* substrings_filename;
+    struct string* substrings;
+    size_t substrings_count;
+    unsigned char** input_filenames;
+    size_t input_filenames_count;
+    unsigned char* output_filename;
+    unsigned char* save_index_filename;
+    unsigned char* load_index_filename;
+    unsigned char* keyword_stats_filename;
+    unsigned char* serve_path;
+    unsigned char* connect_path;
+    bool range;
+    size_t range_start;
+    size_t range_end;
+    bool case_insensitive;
+    bool invert;
+    bool print_match;
+    bool all_matches;
+    bool longest;
+    bool count;
+    bool recursive;
+    bool with_filename;
+    enum progress_format progress;
+    unsigned char delimiter;
+    enum trie_engine engine;
+    size_t threads_count;
+    size_t output_buffer_size;
+    bool no_mmap;
+    enum compression compress_output;
+    bool no_prefilter;
+    enum simd_level simd_level;
+    bool stats;
+    bool explain;
+    bool huge_pages;
+};
+
+struct options options_init()
+{
+    struct options options;
+    memset(&options, 0, sizeof(struct options));
+    options.engine = TRIE_ENGINE_AUTO;
+    options.threads_count = 1;
+    options.output_buffer_size = OSTREAM_BUFFER_DEFAULT_CAPACITY;
+    options.simd_level = SIMD_LEVEL_AVX512;
+    options.range_end = SIZE_MAX;
+    options.delimiter = '\n';
+    return options;
+}
+
+/**
+ * Loads or builds the search index the options point to as the current one. Returns false with index_error
+ * if the files do not make an index, the current one is then left for trie_destroy().
+ */
+bool findany_build_index(const struct options* options)
+{
+    if (options->load_index_filename != NULL)
+    {
+        // A server keeps its index for long, the file may be overwritten in the meantime and must not be mapped
+        if (!trie_load(options->load_index_filename, options->engine, options->huge_pages, options->delimiter, options->serve_path == NULL))
+            return false;
+        if (options->case_insensitive && !trie.case_insensitive)
+            return index_fail("Index file %s was built for a case-sensitive search", options->load_index_filename);
+    }
+    else
+    {
+        // Keywords that start with a shorter one matter only to the modes that print every or the longest match,
+        // to the counts of every keyword and to an index that may be loaded in any mode
+        bool prune = !options->all_matches && !options->longest && options->keyword_stats_filename == NULL
+            && options->save_index_filename == NULL;
+        trie_init(options->engine, options->case_insensitive, options->huge_pages, options->delimiter);
+        if (options->substrings_filename == NULL)
+            trie_build_from_args(options->substrings, options->substrings_count, options->threads_count, prune);
+        else if (!trie_build_from_file(options->substrings_filename, options->threads_count, prune))
+            return false;
+    }
+    const char* engine_reason = trie_select_engine();
+    if (engine_reason == NULL)
+        return false;
+    trie_build_automaton();
+    trie_build_prefilter(!options->no_prefilter && trie.engine != TRIE_ENGINE_MEMMEM);
+    if (options->explain)
+        trie_explain(engine_reason, !options->no_prefilter);
+    return true;
+}
+
+/**
+ * Opens the output file, or returns standard output if there is none
+ */
+int findany_open_output(const struct options* options)
+{
+    if (options->output_filename == NULL)
+    {
+#ifdef _WIN32
+        setmode(STDOUT_FILENO, O_BINARY);
+#endif /* _WIN32 */
+        return STDOUT_FILENO;
+    }
+    int file = open(options->output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
+    if (file < 0)
+        fatal("No access to file %s", options->output_filename);
+    return file;
+}
+
+void findany(const struct options* options)
+{
+    simd_init(options->simd_level);
+    stats_init(options->stats);
+
+    double build_start = time_now();
+    if (!findany_build_index(options))
+        fatal("%s", index_error);
+    if (options->stats)
+    {
+        char size[32];
+        format_size(trie_memory_size(), size);
+        fprintf(stderr, "Index: %zu substrings, %zu nodes, %s of memory, %s in %.3f s\n", trie_keywords_count(), trie.length, size,
+            options->load_index_filename != NULL ? "loaded" : "built", time_now() - build_start);
+        if (options->load_index_filename == NULL)
+        {
+            fprintf(stderr, "Pruning: %zu repeated and %zu redundant substrings dropped, %zu nodes saved\n",
+                trie.duplicates_count, trie.pruned_count, trie.pruned_nodes);
+        }
+    }
+
+    if (options->save_index_filename != NULL)
+    {
+        trie_save(options->save_index_filename);
+        trie_destroy();
+        stats_destroy();
+        return;
+    }
+
+    // Initialize input
+    struct file_list input_files = file_list_init();
+    if (options->input_filenames_count == 0)
+        file_list_add(&input_files, NULL, 0, false);
+    for (size_t i = 0; i < options->input_filenames_count; i++)
+        file_list_add_path(&input_files, options->input_filenames[i], options->recursive, false);
+    if (options->range && (input_files.length != 1 || !input_files.data[0].regular))
+        fatal("A range can be searched only in a single regular file");
+
+    // Initialize output
+    int output_file = findany_open_output(options);
+    struct ostream output_stream = ostream_init(output_file, options->output_buffer_size);
+    if (options->compress_output != COMPRESSION_NONE)
+        output_stream.encoder = encoder_init(options->compress_output, options->threads_count);
+    ostream_start_writer(&output_stream);
+    progress_init(options->progress, options->output_filename != NULL ? stdout : stderr);
+
+    keyword_stats_init(options->keyword_stats_filename != NULL);
+
+    // With a single thread the main thread matches the chunks itself between reading and writing them
+    pool_init(options->threads_count > 1 ? options->threads_count : 0, &input_files, options->no_mmap, options->invert,
+        options->print_match, options->all_matches, options->longest, options->count, options->with_filename,
+        options->range_start, options->range_end);
+    pool_run(&output_stream);
+    if (options->count)
+    {
+        char count[32];
+        int length = sprintf(count, "%zu\n", pool.count_total);
+        ostream_write(&output_stream, count, length);
+    }
+    pool_destroy();
+    double flush_start = options->stats ? time_now() : 0;
+    ostream_destroy(&output_stream);
+    if (options->stats)
+    {
+        stats_local.write_seconds += time_now() - flush_start;
+        stats_merge();
+        stats_print();
+    }
+    if (options->keyword_stats_filename != NULL)
+    {
+        keyword_stats_merge();
+        keyword_stats_write(options->keyword_stats_filename);
+    }
+    keyword_stats_destroy();
+    progress_destroy();
+
+    file_list_destroy(&input_files);
+    if (options->output_filename != NULL)
+        close(output_file);
+    trie_destroy();
+    stats_destroy();
+}
+
+#ifndef _WIN32
+#define SERVER_BACKLOG 64
+
+/**
+ * A line is matched once it is received whole, so a connection that sends a longer one is closed instead of growing
+ * its buffer without a limit
+ */
+#define SERVER_MAX_LINE_LENGTH 64 * 1024 * 1024
+
+/**
+ * A client that starts together with the server retries to connect until the server is listening
+ */
+#define CLIENT_CONNECT_ATTEMPTS 100
+#define CLIENT_CONNECT_INTERVAL_NS 50 * 1000 * 1000
+
+/**
+ * Index shared by the connections of the server. The connections that are open when the index is reloaded
+ * keep the previous one, it is destroyed when the last of them is closed.
+ */
+struct server_index
+{
+    struct trie_index index;
+
+    /**
+     * Number of the open connections that use the index, and one more while it is the current one
+     */
+    size_t references;
+};
+
+/**
+ * The server accepts connections on a Unix socket and serves each of them on a thread of its own. A connection
+ * streams lines in and receives the selected ones as soon as they are matched, the input is over when the client
+ * shuts down its side of the socket. A signal thread reloads the index on SIGHUP and stops the server on SIGINT
+ * and SIGTERM. The open connections are served to the end in both cases.
+ */
+struct
+{
+    const struct options* options;
+    struct sockaddr_un address;
+    int socket;
+    sigset_t signals;
+    pthread_t signal_thread;
+    struct server_index* index;
+    size_t connections;
+    bool stopped;
+    pthread_mutex_t mutex;
+    pthread_cond_t closed_cond;
+} server;
+
+void socket_address(struct sockaddr_un* address, const unsigned char* path)
+{
+    if (strlen(path) >= sizeof(address->sun_path))
+        fatal("Socket path %s is too long", path);
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+}
+
+/**
+ * Returns the connected socket, or -1 with errno of the failed connect()
+ */
+int socket_connect(const struct sockaddr_un* address)
+{
+    int file = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (file < 0)
+        return -1;
+    if (connect(file, (const struct sockaddr*)address, sizeof(struct sockaddr_un)) == 0)
+        return file;
+    int error = errno;
+    close(file);
+    errno = error;
+    return -1;
+}
+
+bool socket_send(int file, const void* buf, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t result = send(file, buf, count, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += result;
+        count -= result;
+    }
+    return true;
+}
+
+/**
+ * Returns NULL with index_error if the files do not make an index
+ */
+struct server_index* server_build_index()
+{
+    struct server_index* index = malloc_or_fatal(sizeof(struct server_index));
+    memset(&index->index, 0, sizeof(struct trie_index));
+    index->references = 1;
+    struct trie_index* previous = trie_current;
+    trie_current = &index->index;
+    bool built = findany_build_index(server.options);
+    if (!built)
+        trie_destroy();
+    trie_current = previous;
+    if (built)
+        return index;
+    free(index);
+    return NULL;
+}
+
+void server_release_index(struct server_index* index)
+{
+    pthread_mutex_lock(&server.mutex);
+    bool unused = --index->references == 0;
+    pthread_mutex_unlock(&server.mutex);
+    if (!unused)
+        return;
+    struct trie_index* previous = trie_current;
+    trie_current = &index->index;
+    trie_destroy();
+    trie_current = previous;
+    free(index);
+}
+
+/**
+ * Builds the index again from its file and makes it current for the connections accepted afterwards
+ */
+void server_reload()
+{
+    // The current index is kept if the files do not make a new one, the open connections are not dropped
+    double start = time_now();
+    struct server_index* index = server_build_index();
+    if (index == NULL)
+    {
+        fprintf(stderr, "Index is not reloaded: %s\n", index_error);
+        return;
+    }
+    pthread_mutex_lock(&server.mutex);
+    struct server_index* previous = server.index;
+    server.index = index;
+    pthread_mutex_unlock(&server.mutex);
+    server_release_index(previous);
+    fprintf(stderr, "Index reloaded in %.3f s\n", time_now() - start);
+}
+
+void* server_signal_handler(void* arg)
+{
+    (void)arg;
+    while (true)
+    {
+        int number;
+        if (sigwait(&server.signals, &number) != 0)
+            continue;
+        if (number == SIGHUP)
+        {
+            server_reload();
+            continue;
+        }
+        pthread_mutex_lock(&server.mutex);
+        server.stopped = true;
+        pthread_mutex_unlock(&server.mutex);
+
+        // Wakes up the main thread waiting in accept()
+        shutdown(server.socket, SHUT_RDWR);
+        break;
     }
-    return 0;
+    return NULL;
 }
 
-void trie_build_from_file(unsigned char* substrings_filename, bool case_insensitive)
+/**
+ * Serves a single connection. The lines are matched as a chunk of the pool each time a read completes some of them,
+ * so the output of a slow stream is not held back. A line of SERVER_MAX_LINE_LENGTH bytes or more fails the connection.
+ */
+void* server_connection(void* arg)
 {
-    int file = open(substrings_filename, O_RDONLY | O_BINARY);
-    if (file < 0)
-        fatal("No access to file %s", substrings_filename);
+    int file = (intptr_t)arg;
+    pthread_mutex_lock(&server.mutex);
+    struct server_index* index = server.index;
+    index->references++;
+    pthread_mutex_unlock(&server.mutex);
+    trie_current = &index->index;
 
-    struct fstream stream = fstream_init(file);
-    struct string buffer = string_init();
-    while (true)
+    struct pool_chunk chunk;
+    chunk.input = string_init();
+    chunk.segments = NULL;
+    chunk.segments_capacity = 0;
+    chunk.output = string_init();
+    chunk.matches = trie_matches_init();
+    chunk.line_continued = false;
+    chunk.line_open = false;
+    chunk.line_overlap = 0;
+    string_expand(&chunk.input, FSTREAM_BUFFER_INITIAL_CAPACITY);
+    size_t buffer_size = 0;
+    size_t input_offset = 0;
+    size_t count_total = 0;
+    bool eof = false;
+    bool failed = false;
+    while (!eof && !failed)
     {
-        struct string substring = fstream_read_line(&stream, &buffer, '\n');
-        if (substring.length == 0)
-            break;
-        if (case_insensitive)
-            string_to_lower(substring, &substring);
+        if (buffer_size == chunk.input.length)
+        {
+            // The buffer is only full here if it holds a part of a single line
+            if (buffer_size >= SERVER_MAX_LINE_LENGTH)
+            {
+                failed = true;
+                continue;
+            }
+            string_expand(&chunk.input, chunk.input.length * 2);
+        }
+        ssize_t received = recv(file, chunk.input.data + buffer_size, chunk.input.length - buffer_size, 0);
+        if (received < 0)
+        {
+            failed = errno != EINTR;
+            continue;
+        }
+        eof = received == 0;
 
-        string_trim_end(&substring, '\n');
-        string_trim_end(&substring, '\r');
+        // The unmatched tail holds no line break, so only the received bytes are searched for the last one
+        size_t length = buffer_size + received;
+        if (!eof)
+        {
+            while (length > buffer_size && chunk.input.data[length - 1] != trie.delimiter)
+                length--;
+        }
+        bool complete = length > buffer_size || (eof && length > 0);
+        buffer_size += received;
+        if (!complete)
+            continue;
 
-        trie_add(substring);
+        chunk.lines = (struct string) {chunk.input.data, length};
+        chunk.segments_count = 0;
+        pool_add_segment(&chunk, (struct string) {NULL, 0}, 0, length, input_offset);
+        pool_match_chunk(&chunk);
+        failed = !socket_send(file, chunk.output.data, chunk.output_length);
+        count_total += chunk.count;
+        memmove(chunk.input.data, chunk.input.data + length, buffer_size - length);
+        buffer_size -= length;
+        input_offset += length;
+    }
+    if (!failed && pool.count)
+    {
+        char count[32];
+        int length = sprintf(count, "%zu\n", count_total);
+        socket_send(file, count, length);
     }
-
     close(file);
-    string_destroy(&buffer);
-    fstream_destroy(&stream);
+
+    string_destroy(&chunk.input);
+    free(chunk.segments);
+    string_destroy(&chunk.output);
+    trie_matches_destroy(&chunk.matches);
+    trie_current = &trie_default;
+    server_release_index(index);
+    pthread_mutex_lock(&server.mutex);
+    server.connections--;
+    pthread_cond_signal(&server.closed_cond);
+    pthread_mutex_unlock(&server.mutex);
+    return NULL;
 }
 
-void trie_build_from_args(struct string* substrings, size_t substrings_count, bool case_insensitive)
+void server_listen(const unsigned char* path)
 {
-    for (size_t i = 0; i < substrings_count; i++)
+    socket_address(&server.address, path);
+    server.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.socket < 0)
+        fatal("Failed to create a socket");
+    if (bind(server.socket, (struct sockaddr*)&server.address, sizeof(struct sockaddr_un)) < 0)
     {
-        struct string substring = substrings[i];
-        if (substring.length == 0)
-            continue;
-        if (case_insensitive)
-            string_to_lower(substring, &substring);
-
-        trie_add(substring);
+        // A socket left behind by a server that did not stop cleanly is replaced, the one of a running server is not
+        bool stale = false;
+        struct stat stat;
+        if (errno == EADDRINUSE && lstat(path, &stat) == 0 && S_ISSOCK(stat.st_mode))
+        {
+            int probe = socket_connect(&server.address);
+            stale = probe < 0 && errno == ECONNREFUSED;
+            if (probe >= 0)
+                close(probe);
+        }
+        if (!stale || unlink(path) < 0 || bind(server.socket, (struct sockaddr*)&server.address, sizeof(struct sockaddr_un)) < 0)
+            fatal("Failed to listen on %s", path);
     }
+    if (listen(server.socket, SERVER_BACKLOG) < 0)
+        fatal("Failed to listen on %s", path);
 }
 
-struct trie_match {
-    size_t offset;
-    size_t length;
-};
-
-struct trie_match trie_find_match(struct string str)
+void findany_serve(const struct options* options)
 {
-    string_trim_end(&str, '\n');
-    string_trim_end(&str, '\r');
-    struct trie_match match;
-    match.offset = 0;
-    match.length = 0;
-    for (; match.offset < str.length; match.offset++)
+    simd_init(options->simd_level);
+    server.options = options;
+    server.connections = 0;
+    server.stopped = false;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.closed_cond, NULL);
+
+    // The signals are taken by the signal thread only, the other threads inherit the mask. A client that goes away
+    // fails the send() to its connection instead of stopping the server.
+    sigemptyset(&server.signals);
+    sigaddset(&server.signals, SIGHUP);
+    sigaddset(&server.signals, SIGINT);
+    sigaddset(&server.signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &server.signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Clients that connect while the index is being built wait in the backlog
+    server_listen(options->serve_path);
+    server.index = server_build_index();
+    if (server.index == NULL)
+        fatal("%s", index_error);
+
+    // Every connection matches its chunks with the filter of the pool
+    pool.invert = options->invert;
+    pool.print_match = options->print_match;
+    pool.all_matches = options->all_matches;
+    pool.longest = options->longest;
+    pool.count = options->count;
+    pool.with_filename = false;
+    pool.terminate_lines = false;
+
+    if (pthread_create(&server.signal_thread, NULL, server_signal_handler, NULL) != 0)
+        fatal("Failed to create a thread");
+    fprintf(stderr, "Listening on %s\n", options->serve_path);
+    while (true)
     {
-        match.length = trie_match_str(string_sub(str, match.offset, str.length - match.offset));
-        if (match.length > 0)
-            return match;
+        int file = accept(server.socket, NULL, NULL);
+        if (file < 0)
+        {
+            pthread_mutex_lock(&server.mutex);
+            bool stopped = server.stopped;
+            pthread_mutex_unlock(&server.mutex);
+            if (stopped)
+                break;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fatal("Failed to accept a connection on %s", options->serve_path);
+        }
+        pthread_mutex_lock(&server.mutex);
+        server.connections++;
+        pthread_mutex_unlock(&server.mutex);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_connection, (void*)(intptr_t)file) != 0)
+            fatal("Failed to create a thread");
+        pthread_detach(thread);
     }
-    return match;
+
+    pthread_join(server.signal_thread, NULL);
+    close(server.socket);
+    unlink(options->serve_path);
+    pthread_mutex_lock(&server.mutex);
+    while (server.connections > 0)
+        pthread_cond_wait(&server.closed_cond, &server.mutex);
+    pthread_mutex_unlock(&server.mutex);
+    server_release_index(server.index);
+    pthread_mutex_destroy(&server.mutex);
+    pthread_cond_destroy(&server.closed_cond);
 }
 
-void trie_destroy()
+struct client_input
 {
-    free(trie.nodes);
-    trie.nodes = NULL;
-}
+    struct file_list* files;
+    int socket;
+    unsigned char delimiter;
+    bool failed;
 
-void format_size(size_t size, char* buffer)
+    /**
+     * Length of the line being sent. The server fails the request once it reaches SERVER_MAX_LINE_LENGTH,
+     * the same limit tells the client why the connection was closed.
+     */
+    size_t line_length;
+    bool line_too_long;
+};
+
+/**
+ * Adds the data to the length of the line being sent. A buffer is much shorter than the limit, so only the line
+ * that continues from the previous buffer may reach it.
+ */
+void client_count_line(struct client_input* input, const unsigned char* data, size_t size)
 {
-    if ((size >> 11) == 0)
-        sprintf(buffer, "%zu", size);
-    else if ((size >> 21) == 0)
-    {
-        float k = (float) size / 1024.0f;
-        sprintf(buffer, "%.2fK", k);
-    }
-    else if ((size >> 31) == 0)
+    void* delimptr = _memchr(data, input->delimiter, size);
+    if (delimptr == NULL)
+        input->line_length += size;
+    else if (input->line_length + (delimptr - (void*)data) < SERVER_MAX_LINE_LENGTH)
     {
-        float m = (float) size / (1024.0f * 1024.0f);
-        sprintf(buffer, "%.2fM", m);
+        size_t length = 0;
+        while (data[size - length - 1] != input->delimiter)
+            length++;
+        input->line_length = length;
     }
     else
+        input->line_length = SERVER_MAX_LINE_LENGTH;
+    input->line_too_long = input->line_length >= SERVER_MAX_LINE_LENGTH;
+}
+
+/**
+ * Sends the input files one after another and shuts down the sending side of the socket to end the input.
+ * Compressed files are decompressed here, the server only reads lines. Once a line is too long for the server,
+ * the rest of the input is not sent.
+ */
+void* client_send_input(void* arg)
+{
+    struct client_input* input = arg;
+    for (size_t i = 0; i < input->files->length && !input->failed && !input->line_too_long; i++)
     {
-        float g = (float) size / (1024.0f * 1024.0f * 1024.0f);
-        sprintf(buffer, "%.2fG", g);
+        struct file_entry* entry = &input->files->data[i];
+        int file = pool_open_file(entry);
+        struct fstream stream = fstream_init(file);
+        fstream_detect_compression(&stream);
+        unsigned char last = input->delimiter;
+        do
+        {
+            if (stream.buffer_size > 0)
+                last = ((unsigned char*)stream.buffer)[stream.buffer_size - 1];
+            input->failed = !socket_send(input->socket, stream.buffer, stream.buffer_size);
+            client_count_line(input, stream.buffer, stream.buffer_size);
+            stream.buffer_size = 0;
+        }
+        while (!input->failed && !input->line_too_long && fstream_read_to_buffer(&stream));
+
+        // The last line of a file is not continued by the first one of the next file
+        if (!input->failed && !input->line_too_long && last != input->delimiter && i + 1 < input->files->length)
+        {
+            input->failed = !socket_send(input->socket, &input->delimiter, 1);
+            input->line_length = 0;
+        }
+        fstream_destroy(&stream);
+        if (file != STDIN_FILENO)
+            close(file);
     }
+    shutdown(input->socket, SHUT_WR);
+    return NULL;
 }
 
-char* build_progress_str(size_t processed, size_t size)
+void findany_connect(const struct options* options)
 {
-    static char buffer[1024];
-
-    char processed_str[256];
-    char size_str[256];
-    format_size(processed, processed_str);
-    format_size(size, size_str);
-    
-    // Progress bar
-    char progress_str[256] = "";
-    if (size > 0)
+    simd_init(options->simd_level);
+    struct sockaddr_un address;
+    socket_address(&address, options->connect_path);
+    int file;
+    for (size_t attempt = 0; (file = socket_connect(&address)) < 0; attempt++)
     {
-        const int progress_bar_len = 32;
-        char progress_bar[progress_bar_len + 1];
-        float progress = (float) processed / (float) size;
-        memset(progress_bar, ' ', progress_bar_len);
-        progress_bar[0] = progress_bar[progress_bar_len - 1] = '|';
-        progress_bar[progress_bar_len] = '\0';
-        for (int i = 0; i < (progress_bar_len - 2) * progress; i++)
-            progress_bar[i + 1] = '*';
-        sprintf(progress_str, "%s %.2f%%   ", progress_bar, progress * 100.0f);
+        if ((errno != ENOENT && errno != ECONNREFUSED) || attempt == CLIENT_CONNECT_ATTEMPTS)
+            fatal("Failed to connect to %s", options->connect_path);
+        struct timespec interval = {0, CLIENT_CONNECT_INTERVAL_NS};
+        nanosleep(&interval, NULL);
     }
 
-    sprintf(buffer, "%s%s / %s", progress_str, processed_str, size > 0 ? size_str : "?");
+    struct file_list input_files = file_list_init();
+    if (options->input_filenames_count == 0)
+        file_list_add(&input_files, NULL, 0, false);
+    for (size_t i = 0; i < options->input_filenames_count; i++)
+        file_list_add_path(&input_files, options->input_filenames[i], options->recursive, false);
 
-    return buffer;
+    int output_file = findany_open_output(options);
+    struct ostream output_stream = ostream_init(output_file, options->output_buffer_size);
+    if (options->compress_output != COMPRESSION_NONE)
+        output_stream.encoder = encoder_init(options->compress_output, options->threads_count);
+
+    // A server that closes the connection early fails the send() instead of raising SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // The output is received while the input is still being sent, otherwise both sides could wait for each other
+    // with full socket buffers
+    struct client_input input = {&input_files, file, options->delimiter, false, 0, false};
+    pthread_t sender;
+    if (pthread_create(&sender, NULL, client_send_input, &input) != 0)
+        fatal("Failed to create a thread");
+    void* buffer = malloc_or_fatal(FSTREAM_BUFFER_INITIAL_CAPACITY);
+    bool reset = false;
+    while (true)
+    {
+        ssize_t count = recv(file, buffer, FSTREAM_BUFFER_INITIAL_CAPACITY, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && errno != ECONNRESET)
+            fatal("Failed to read");
+        // The server closes the connection while the input is unread if it fails the request or stops
+        reset = count < 0;
+        if (count <= 0)
+            break;
+        ostream_write(&output_stream, buffer, count);
+        ostream_flush_interactive(&output_stream);
+    }
+    pthread_join(sender, NULL);
+    free(buffer);
+    ostream_destroy(&output_stream);
+    if (input.line_too_long)
+        fatal("The server closed the connection, lines must be shorter than %d bytes", SERVER_MAX_LINE_LENGTH);
+    if (reset || input.failed)
+        fatal("The server closed the connection");
+    close(file);
+    file_list_destroy(&input_files);
+    if (options->output_filename != NULL)
+        close(output_file);
+}
+#else /* _WIN32 */
+void findany_serve(const struct options* options)
+{
+    fatal("--serve is not supported on Windows");
 }
 
-void print_ws(size_t length)
+void findany_connect(const struct options* options)
 {
-    char buffer[256];
-    memset(buffer, ' ', length);
-    buffer[length] = '\0';
-    printf("%s", buffer);
+    fatal("--connect is not supported on Windows");
 }
+#endif /* _WIN32 */
 
-#define PRINT_PROGRESS_MIN_DIFF_BYTES 1024 * 1024
+#ifdef FINDANY_LIBRARY
+#include "findany.h"
 
-void print_progress(size_t processed, size_t size, bool force)
-{
-    static clock_t prevtime = 0;
-    static size_t prevprocessed = 0;
-    static size_t prevlength = 0;
-    if (processed - prevprocessed < PRINT_PROGRESS_MIN_DIFF_BYTES && !force)
-        return;
-    clock_t time = clock();
-    if (prevtime == 0)
-    {
-        prevtime = time;
-        return;
-    }
-    if (time - prevtime > CLOCKS_PER_SEC || force)
-    {
-        if (processed > size)
-            size = processed;
+pthread_once_t library_once = PTHREAD_ONCE_INIT;
 
-        char* progress_str = build_progress_str(processed, size);
-        size_t length = strlen(progress_str);
-        printf("\r%s", progress_str);
-        fflush(stdout);
-        if (prevlength > length)
-            print_ws(prevlength - length);
-        prevtime = time;
-        prevprocessed = processed;
-        prevlength = length;
-    }
+void library_init()
+{
+    string_lower_lookup_init();
+    simd_init(SIMD_LEVEL_AVX512);
 }
 
-void handle_line(struct string line_for_search, struct string line_original, size_t input_size, int output_file, unsigned char* output_filename, bool invert, bool print_match, size_t* progress)
+struct findany_matcher
 {
-    struct trie_match match = trie_find_match(line_for_search);
-    bool matches = match.length > 0;
-    if (matches ^ invert)
-    {
-        if (print_match)
-        {
-            struct string match_str = string_sub(line_original, match.offset, match.length);
-            write_or_fatal(output_file, match_str.data, match_str.length);
-            write_or_fatal(output_file, "\n", 1);
-        }
-        else
-            write_or_fatal(output_file, line_original.data, line_original.length);
-    }
-    *progress += line_original.length;
-    if (output_filename != NULL)
-        print_progress(*progress, input_size, false);
-}
+    struct trie_index index;
+    bool longest;
+};
 
-void findany(unsigned char* substrings_filename, struct string* substrings, size_t substrings_count, unsigned char* input_filename, unsigned char* output_filename, bool case_insensitive, bool invert, bool print_match)
+FINDANY_API unsigned int findany_abi_version(void)
 {
-    trie_init();
-    if (substrings_filename != NULL)
-        trie_build_from_file(substrings_filename, case_insensitive);
-    else
-        trie_build_from_args(substrings, substrings_count, case_insensitive);
-    trie_trim();
+    return FINDANY_ABI_VERSION;
+}
 
-    // Initialize input
-    int input_file = STDIN_FILENO;
-    bool input_need_close = false;
-    size_t input_size = 0;
-    if (input_filename != NULL)
-    {
-        input_file = open(input_filename, O_RDONLY | O_BINARY);
-        if (input_file < 0)
-            fatal("No access to file %s", input_filename);
-        input_need_close = true;
-        struct stat stat;
-        if (fstat(input_file, &stat) >= 0)
-            input_size = stat.st_size;
-    }
-#ifdef _WIN32
-    else
-        setmode(input_file, O_BINARY);
-#endif /* _WIN32 */
+FINDANY_API findany_matcher* findany_compile(const char* const* keywords, const size_t* lengths, size_t count, unsigned int flags)
+{
+    pthread_once(&library_once, library_init);
+    findany_matcher* matcher = malloc_or_fatal(sizeof(findany_matcher));
+    matcher->longest = (flags & FINDANY_LONGEST) != 0;
 
-    // Initialize output
-    int output_file = STDOUT_FILENO;
-    bool output_need_close = false;
-    if (output_filename != NULL)
+    // The keywords are lowercased in place for a case-insensitive search, so they are copied into a single buffer
+    size_t total_length = 0;
+    for (size_t i = 0; i < count; i++)
+        total_length += lengths != NULL ? lengths[i] : strlen(keywords[i]);
+    unsigned char* data = malloc_or_fatal(total_length > 0 ? total_length : 1);
+    struct string* substrings = malloc_or_fatal(sizeof(struct string) * (count > 0 ? count : 1));
+    for (size_t i = 0, offset = 0; i < count; i++)
     {
-        output_file = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
-        if (output_file < 0)
-            fatal("No access to file %s", output_filename);
-        output_need_close = true;
+        size_t length = lengths != NULL ? lengths[i] : strlen(keywords[i]);
+        memcpy(data + offset, keywords[i], length);
+        substrings[i] = (struct string) {data + offset, length};
+        offset += length;
     }
-#ifdef _WIN32
-    else
-        setmode(output_file, O_BINARY);
-#endif /* _WIN32 */
 
-    struct fstream input_stream = fstream_init(input_file);
-    struct string buffer = string_init();
-    size_t progress = 0;
+    struct trie_index* previous = trie_current;
+    trie_current = &matcher->index;
+    trie_init((flags & FINDANY_ENGINE_TRIE) != 0 ? TRIE_ENGINE_TRIE : TRIE_ENGINE_AHO_CORASICK, (flags & FINDANY_CASE_INSENSITIVE) != 0, false, '\n');
+    trie.keep_line_end = true;
+    trie_build_from_args(substrings, count, 1, !matcher->longest);
+    trie_build_automaton();
+    trie_build_prefilter(true);
+    trie_current = previous;
+
+    free(substrings);
+    free(data);
+    return matcher;
+}
 
-    if (case_insensitive)
+FINDANY_API int findany_match(const findany_matcher* matcher, const void* data, size_t length, findany_result* match)
+{
+    struct trie_index* previous = trie_current;
+    trie_current = (struct trie_index*)&matcher->index;
+    struct trie_match found = trie_find_match((struct string) {(unsigned char*)data, length}, match != NULL, matcher->longest);
+    trie_current = previous;
+    if (match != NULL)
     {
-        struct string lower_buffer = string_init();
-        while (true)
-        {
-            struct string line = fstream_read_line(&input_stream, &buffer, '\n');
-            if (line.length == 0)
-                break;
-            string_to_lower(line, &lower_buffer);
-            handle_line(string_sub(lower_buffer, 0, line.length), line, input_size, output_file, output_filename, invert, print_match, &progress);
-        }
-        string_destroy(&lower_buffer);
+        match->offset = found.offset;
+        match->length = found.length;
     }
-    else
+    return found.length > 0;
+}
+
+FINDANY_API size_t findany_match_batch(const findany_matcher* matcher, const void* const* data, const size_t* lengths, size_t count,
+    findany_result* matches, int leftmost)
+{
+    struct trie_index* previous = trie_current;
+    trie_current = (struct trie_index*)&matcher->index;
+    struct string lines[POOL_BATCH_LINES];
+    struct trie_match found[POOL_BATCH_LINES];
+    size_t matched = 0;
+    for (size_t start = 0; start < count; start += POOL_BATCH_LINES)
     {
-        while (true)
+        size_t batch = count - start < POOL_BATCH_LINES ? count - start : POOL_BATCH_LINES;
+        for (size_t i = 0; i < batch; i++)
+            lines[i] = (struct string) {(unsigned char*)data[start + i], lengths[start + i]};
+        trie_find_matches(lines, batch, matches != NULL && leftmost, matcher->longest, found);
+        for (size_t i = 0; i < batch; i++)
         {
-            struct string line = fstream_read_line(&input_stream, &buffer, '\n');
-            if (line.length == 0)
-                break;
-            handle_line(line, line, input_size, output_file, output_filename, invert, print_match, &progress);
+            matched += found[i].length > 0;
+            if (matches != NULL)
+            {
+                matches[start + i].offset = found[i].offset;
+                matches[start + i].length = found[i].length;
+            }
         }
     }
-    if (output_filename != NULL)
-    {
-        print_progress(progress, input_size, true);
-        printf("\n");
-    }
+    trie_current = previous;
+    return matched;
+}
 
-    string_destroy(&buffer);
-    fstream_destroy(&input_stream);
-    if (input_need_close)
-        close(input_file);
-    if (output_need_close)
-        close(output_file);
+FINDANY_API void findany_free(findany_matcher* matcher)
+{
+    if (matcher == NULL)
+        return;
+    struct trie_index* previous = trie_current;
+    trie_current = &matcher->index;
     trie_destroy();
+    trie_current = previous;
+    free(matcher);
 }
-
+#else /* FINDANY_LIBRARY */
 int main(int argc, char **argv)
 {
     setlocale(LC_ALL, "");
+    string_lower_lookup_init();
 
-    unsigned char* substrings_filename = NULL;
-    struct string* substrings = NULL;
-    size_t substrings_count = 0;
-    unsigned char* input_filename = NULL;
-    unsigned char* output_filename = NULL;
-    bool case_insensitive = false;
-    bool invert = false;
-    bool print_match = false;
+    struct options options = options_init();
 
     if (argc <= 1)
     {
@@ -738,7 +5809,8 @@ int main(int argc, char **argv)
     else
     {
         int optc;
-        while ((optc = getopt_long(argc, argv, "hivo:s:m", long_options, NULL)) != -1)
+        bool progress_given = false;
+        while ((optc = getopt_long(argc, argv, "hivo:s:mcrHzj:", long_options, NULL)) != -1)
         {
             switch (optc)
             {
@@ -747,64 +5819,251 @@ int main(int argc, char **argv)
                 exit(EXIT_SUCCESS);
 
             case 'i':
-                case_insensitive = true;
+                options.case_insensitive = true;
                 break;
 
             case 'v':
-                invert = true;
+                options.invert = true;
                 break;
 
             case 'o':
-                output_filename = optarg;
+                options.output_filename = optarg;
                 break;
 
             case 's':
-                substrings = realloc_or_fatal(substrings, sizeof(struct string) * (substrings_count + 1));
+                options.substrings = realloc_or_fatal(options.substrings, sizeof(struct string) * (options.substrings_count + 1));
                 struct string substring = {optarg, strlen(optarg)};
-                substrings[substrings_count++] = substring;
+                options.substrings[options.substrings_count++] = substring;
                 break;
 
             case 'm':
-                print_match = true;
+                options.print_match = true;
+                break;
+
+            case 'c':
+                options.count = true;
+                break;
+
+            case 'r':
+                options.recursive = true;
+                break;
+
+            case 'H':
+                options.with_filename = true;
+                break;
+
+            case 'z':
+                options.delimiter = '\0';
+                break;
+
+            case OPTION_DELIMITER:
+                if (!parse_delimiter(optarg, &options.delimiter))
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case OPTION_ALL_MATCHES:
+                options.all_matches = true;
+                break;
+
+            case OPTION_LONGEST:
+                options.longest = true;
+                break;
+
+            case 'j':
+            {
+                char* end;
+                options.threads_count = strtoul(optarg, &end, 10);
+                if (*end != '\0' || options.threads_count == 0)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+
+            case OPTION_OUTPUT_BUFFER:
+                if (!parse_size(optarg, &options.output_buffer_size) || options.output_buffer_size == 0)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
                 break;
 
+            case OPTION_NO_MMAP:
+                options.no_mmap = true;
+                break;
+
+            case OPTION_SAVE_INDEX:
+                options.save_index_filename = optarg;
+                break;
+
+            case OPTION_LOAD_INDEX:
+                options.load_index_filename = optarg;
+                break;
+
+            case OPTION_NO_PREFILTER:
+                options.no_prefilter = true;
+                break;
+
+            case OPTION_HUGE_PAGES:
+                options.huge_pages = true;
+                break;
+
+            case OPTION_STATS:
+                options.stats = true;
+                break;
+
+            case OPTION_EXPLAIN:
+                options.explain = true;
+                break;
+
+            case OPTION_KEYWORD_STATS:
+                options.keyword_stats_filename = optarg;
+                break;
+
+            case OPTION_SERVE:
+                options.serve_path = optarg;
+                break;
+
+            case OPTION_CONNECT:
+                options.connect_path = optarg;
+                break;
+
+            case OPTION_RANGE:
+            {
+                char* separator = strchr(optarg, ':');
+                if (separator == NULL)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                *separator = '\0';
+                options.range = true;
+                if ((*optarg != '\0' && !parse_size(optarg, &options.range_start))
+                    || (separator[1] != '\0' && !parse_size(separator + 1, &options.range_end))
+                    || options.range_start > options.range_end)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+
+            case OPTION_COMPRESS_OUTPUT:
+            {
+                size_t compression = COMPRESSION_GZIP;
+                while (compression <= COMPRESSION_LZ4 && strcmp(optarg, compression_names[compression]) != 0)
+                    compression++;
+                if (compression > COMPRESSION_LZ4)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                options.compress_output = compression;
+                break;
+            }
+
+            case OPTION_PROGRESS:
+            {
+                size_t format = PROGRESS_BAR;
+                if (optarg != NULL)
+                {
+                    format = PROGRESS_NONE;
+                    while (format <= PROGRESS_JSON && strcmp(optarg, progress_format_names[format]) != 0)
+                        format++;
+                }
+                if (format > PROGRESS_JSON)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                options.progress = format;
+                progress_given = true;
+                break;
+            }
+
+            case OPTION_SIMD:
+            {
+                size_t level = 0;
+                while (level <= SIMD_LEVEL_AVX512 && strcmp(optarg, simd_level_names[level]) != 0)
+                    level++;
+                if (level > SIMD_LEVEL_AVX512)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                options.simd_level = level;
+                break;
+            }
+
+            case OPTION_ENGINE:
+            {
+                size_t engine = TRIE_ENGINE_TRIE;
+                while (engine <= TRIE_ENGINE_AUTO && strcmp(optarg, trie_engine_names[engine]) != 0)
+                    engine++;
+                if (engine > TRIE_ENGINE_AUTO)
+                {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                options.engine = engine;
+                break;
+            }
+
             default:
                 print_usage();
                 exit(EXIT_FAILURE);
             }
         }
 
-        if (print_match && invert)
+        if ((options.print_match || options.all_matches) && options.invert)
         {
             print_usage();
             exit(EXIT_FAILURE);
         }
 
-        switch (argc - optind)
+        // The first argument is the file of substrings unless they are given otherwise, the rest are the input files
+        bool substrings_given = options.substrings != NULL || options.load_index_filename != NULL || options.connect_path != NULL;
+        if (!substrings_given)
+        {
+            if (optind == argc)
+            {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            options.substrings_filename = argv[optind++];
+        }
+        options.input_filenames = (unsigned char**)argv + optind;
+        options.input_filenames_count = argc - optind;
+        if (options.substrings != NULL && options.load_index_filename != NULL)
         {
-        case 2:
-            input_filename = argv[optind + 1];
-        case 1:
-            if (substrings != NULL)
-                input_filename = argv[optind];
-            else
-                substrings_filename = argv[optind];
-            break;
-        case 0:
-            if (substrings != NULL)
-                break;
-        default:
             print_usage();
             exit(EXIT_FAILURE);
         }
+        if (!progress_given && options.output_filename != NULL)
+            options.progress = PROGRESS_BAR;
 
-        if (substrings != NULL && substrings_filename != NULL)
+        // The server has no input files and no output of its own, the client takes the search options from the server
+        bool serve_conflicts = options.input_filenames_count > 0 || options.output_filename != NULL || options.recursive
+            || options.with_filename || options.save_index_filename != NULL || options.compress_output != COMPRESSION_NONE
+            || options.stats || options.keyword_stats_filename != NULL || options.connect_path != NULL || options.range || progress_given;
+        bool connect_conflicts = options.substrings != NULL || options.load_index_filename != NULL || options.range || progress_given;
+        if ((options.serve_path != NULL && serve_conflicts) || (options.connect_path != NULL && connect_conflicts))
         {
             print_usage();
             exit(EXIT_FAILURE);
         }
     }
 
-    findany(substrings_filename, substrings, substrings_count, input_filename, output_filename, case_insensitive, invert, print_match);
+    if (options.serve_path != NULL)
+        findany_serve(&options);
+    else if (options.connect_path != NULL)
+        findany_connect(&options);
+    else
+        findany(&options);
     exit(EXIT_SUCCESS);
 }
+#endif /* FINDANY_LIBRARY */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024-2025 Igor Belousov (https://github.com/imbelousov).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * C interface of libfindany. The library is findany.c built with -DFINDANY_LIBRARY, see README.md.
+ * A matcher is compiled once and is read-only afterwards, so any number of threads may match with it at the same time.
+ * The library aborts the process if it runs out of memory, like the command-line tool.
+ */
+
+#ifndef FINDANY_H
+#define FINDANY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#ifdef _WIN32
+#ifdef FINDANY_LIBRARY
+#define FINDANY_API __declspec(dllexport)
+#else /* FINDANY_LIBRARY */
+#define FINDANY_API
+#endif /* FINDANY_LIBRARY */
+#else /* _WIN32 */
+#define FINDANY_API __attribute__((visibility("default")))
+#endif /* _WIN32 */
+
+/**
+ * Incremented on every incompatible change of the functions and the types below
+ */
+#define FINDANY_ABI_VERSION 1
+
+/**
+ * Flags of findany_compile()
+ */
+#define FINDANY_CASE_INSENSITIVE 1
+#define FINDANY_LONGEST 2
+#define FINDANY_ENGINE_TRIE 4
+
+typedef struct findany_matcher findany_matcher;
+
+/**
+ * Leftmost match in a buffer. The length is 0 if there is none.
+ */
+typedef struct findany_result
+{
+    size_t offset;
+    size_t length;
+} findany_result;
+
+FINDANY_API unsigned int findany_abi_version(void);
+
+/**
+ * Builds a matcher for the keywords. If lengths is NULL, the keywords are zero-terminated. Empty keywords are skipped.
+ * With FINDANY_LONGEST the longest of the keywords that start at the leftmost offset is reported instead
+ * of the shortest one. The keywords are copied, the caller keeps them.
+ */
+FINDANY_API findany_matcher* findany_compile(const char* const* keywords, const size_t* lengths, size_t count, unsigned int flags);
+
+/**
+ * Searches the buffer for any of the keywords. Returns 1 if one is found, 0 otherwise. If match is not NULL,
+ * it receives the leftmost match, which takes a little longer to find than any match. The whole buffer is searched,
+ * a trailing line feed or carriage return is not dropped as the command-line tool does with the lines.
+ */
+FINDANY_API int findany_match(const findany_matcher* matcher, const void* data, size_t length, findany_result* match);
+
+/**
+ * Searches each of the buffers, several of them are scanned together. Returns the number of buffers that contain
+ * a keyword. If matches is not NULL, it receives a match of every buffer: the leftmost one if leftmost is set,
+ * otherwise the first one the scan runs into.
+ */
+FINDANY_API size_t findany_match_batch(const findany_matcher* matcher, const void* const* data, const size_t* lengths, size_t count,
+    findany_result* matches, int leftmost);
+
+FINDANY_API void findany_free(findany_matcher* matcher);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FINDANY_H */
@@ -50,7 +50,8 @@ class Test:
     PROGRAM_NAME = "findany"
     CASES_PATH = "cases"
     TMP_PATH = "tmp"
-    BUILD_PATH = os.path.join("..", "build")
+    # The CMake test sets it to the directory of the built binaries
+    BUILD_PATH = os.environ.get("FINDANY_BUILD_PATH", os.path.join("..", "build"))
 
     def setup_method(self):
         shutil.rmtree(self.TMP_PATH, ignore_errors=True)